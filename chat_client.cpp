@@ -8,27 +8,69 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <deque>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <vector>
 #include <boost/asio.hpp>
 #include "chat_message.hpp"
+#include "chat_transport.hpp"
+#include "compression.hpp"
+#include "shm_ring.hpp"
 
 using boost::asio::ip::tcp;
 
 using chat_message_queue = std::deque<chat_message> ;
 
+//客户端配置，命令行中以 --name[=value] 的形式写在端口号后面
+struct client_options
+{
+  bool compress = false;//向服务器协商deflate压缩
+  std::string dictionary;//压缩用的预置字典文件
+  bool tls = false;//使用TLS连接
+  std::string ca_file;//校验服务器证书用的CA文件，为空时用系统默认的CA
+  bool insecure = false;//不校验服务器证书和主机名
+  std::string tls_session;//保存TLS会话票据的文件，下次连接时用它恢复会话
+  std::size_t shm_size = 1 << 20;//共享内存环的数据区字节数，必须与服务器的--shm-size相同
+};
+
 class chat_client
 {
 public:
 //构造函数建立网络连接
+//开启压缩时，连上之后先向服务器协商压缩
+//连接断开后自动重连，并用 /resume 从最后显示的消息接着收
+  using endpoint_type = chat_transport::socket_type::endpoint_type;
+
   chat_client(boost::asio::io_context& io_context,
-      const tcp::resolver::results_type& endpoints)
+      const std::vector<endpoint_type>& endpoints,
+      const std::string& host, const client_options& options)
     : io_context_(io_context),
-      socket_(io_context)
+      endpoints_(endpoints),
+      host_(host),
+      transport_(tcp::socket(io_context)),
+      tls_session_(options.tls_session),
+      retry_timer_(io_context)
   {
-    do_connect(endpoints);
+    if (options.compress)
+      codec_.reset(new deflate_codec(options.dictionary.empty() ? std::string()
+            : deflate_codec::load_dictionary(options.dictionary)));
+    if (options.tls)
+    {
+      tls_context_.reset(new boost::asio::ssl::context(boost::asio::ssl::context::tls_client));
+      configure_tls_client(*tls_context_, host, options.ca_file, options.insecure,
+          tls_session_.empty() ? nullptr : &tls_session_);
+    }
+    do_connect();
   }
 //先使用post函数，捕获列表msg是值拷贝
 //其余部分与chat_server的deliver一致
@@ -44,7 +86,13 @@ public:
           //只有当消息队列为空时，才会从此处成功调用do_write()
           bool write_in_progress = !write_msgs_.empty();
           write_msgs_.push_back(msg);
-          if (!write_in_progress)
+          if (compress_)//服务器已同意压缩，压缩没有收益时照常发送原消息
+          {
+            chat_message compressed;
+            if (codec_->compress(msg, compressed))
+              write_msgs_.back() = compressed;
+          }
+          if (!write_in_progress && connected_)//连接建立之前只排队
           {
             do_write();
           }
@@ -54,66 +102,297 @@ public:
 //也不是在close线程中立即close，而是由io_context自由调度
   void close()
   {
-    boost::asio::post(io_context_, [this]() { socket_.close(); });
+    boost::asio::post(io_context_,
+        [this]()
+        {
+          closing_ = true;
+          retry_timer_.cancel();
+          transport_.close();
+        });
   }
 
 private:
 //异步连接服务器，注册事件后就去做其他事
-  void do_connect(const tcp::resolver::results_type& endpoints)
+//每次连接都换一个新的transport（TLS流不能重用），generation_用来忽略旧连接上残留的回调
+  void do_connect()
   {
-    boost::asio::async_connect(socket_, endpoints,
-        [this](boost::system::error_code ec, tcp::endpoint)
+    unsigned generation = ++generation_;
+    transport_ = chat_transport(tcp::socket(io_context_));
+    if (tls_context_)
+    {
+      transport_.use_tls(*tls_context_);
+      SSL_set_tlsext_host_name(transport_.native_handle(), host_.c_str());
+      if (!tls_session_.empty())
+        load_tls_session(transport_.native_handle(), tls_session_);
+    }
+
+    boost::asio::async_connect(transport_.socket(), endpoints_,
+        [this, generation](boost::system::error_code ec, endpoint_type)
         {
-          if (!ec)
+          if (ec)
           {
-            do_read_header();
+            reconnect(generation);
+            return;
           }
+          if (!transport_.tls())
+          {
+            on_connected();
+            return;
+          }
+
+          transport_.async_handshake(boost::asio::ssl::stream_base::client,
+              [this, generation](boost::system::error_code ec)
+              {
+                if (ec)
+                {
+                  std::cerr << "TLS handshake failed: " << ec.message() << "\n";
+                  reconnect(generation);
+                  return;
+                }
+                if (SSL_session_reused(transport_.native_handle()))
+                  std::cerr << "TLS session resumed\n";
+                transport_.check_ktls();
+                on_connected();
+              });
         });
   }
+//连接出错：关闭并稍后重连，按指数退避
+  void reconnect(unsigned generation)
+  {
+    if (closing_ || generation != generation_)
+      return;
+    ++generation_;//之后旧连接上的回调都被忽略
+    connected_ = false;
+    compress_ = false;
+    transport_.close();
+    std::cerr << "Connection lost, reconnecting in " << backoff_.count() << "s\n";
+
+    retry_timer_.expires_after(backoff_);
+    backoff_ = std::min<std::chrono::seconds>(backoff_ * 2, std::chrono::seconds(30));
+    retry_timer_.async_wait(
+        [this](boost::system::error_code ec)
+        {
+          if (!ec && !closing_)
+            do_connect();
+        });
+  }
+//连接（以及TLS握手）完成后才开始读写，期间用户输入的消息已在队列中等待
+//重连时如果有服务器给的令牌，第一条消息用 /attach 接回原来的会话；
+//没有令牌（或接回失败后）请求从断开前最后显示的那条之后接着收
+  void on_connected()
+  {
+    connected_ = true;
+    backoff_ = std::chrono::seconds(1);
+    expect_token_ = true;
+    default_room_.clear();
+    welcomed_ = false;
+    if (token_.empty() && !room_.empty())
+      write_msgs_.push_front(resume_message());
+    if (token_.empty() && !filters_.empty())//新会话没有过滤条件，恢复之前先订阅上
+      write_msgs_.push_front(make_message("/sub" + filters_));
+    if (token_.empty() && !watching_.empty())//用户名和关注同样要重新告诉新会话
+      write_msgs_.push_front(make_message("/watch" + watching_));
+    if (token_.empty() && !nick_.empty())
+      write_msgs_.push_front(make_message("/nick " + nick_));
+    if (codec_)
+      write_msgs_.push_front(make_message("/compress deflate "
+            + std::to_string(codec_->dictionary_id())));
+    if (!token_.empty())
+      write_msgs_.push_front(make_message("/attach " + token_));
+    if (!write_msgs_.empty())
+      do_write();
+    do_read_header();
+  }
+//从当前聊天室最后显示的那条之后接着收
+//服务器连上时先把会话放进默认聊天室并开始回放，收到要恢复的聊天室的编号通知之前，这些消息都不显示
+  chat_message resume_message()
+  {
+    resuming_ = room_;
+    return make_message("/resume " + room_ + " " + std::to_string(shown_seq_[room_]));
+  }
+
+  static chat_message make_message(const std::string& text)
+  {
+    chat_message msg;
+    msg.body_length(text.size());
+    std::memcpy(msg.body(), text.data(), msg.body_length());
+    msg.encode_header();
+    return msg;
+  }
 //读头部四个字节放到read_msg_.data()
   void do_read_header()
   {
-    boost::asio::async_read(socket_,
+    unsigned generation = generation_;
+    transport_.async_read(
         boost::asio::buffer(read_msg_.data(), chat_message::header_length),
-        [this](boost::system::error_code ec, std::size_t /*length*/)
+        [this, generation](boost::system::error_code ec, std::size_t /*length*/)
         {
+          if (generation != generation_)
+            return;
           if (!ec && read_msg_.decode_header()) //没出错 且 包头合格
           {
             do_read_body(); //读包体
           }
           else  //出错
           {
-            socket_.close();  //客户端关闭  //此处的close其实就是在run()线程下运行，没有问题，可直接调用close
+            reconnect(generation);  //关闭后重连  //此处就是在run()线程下运行，没有问题，可直接调用close
           }
         });
   }
 //读包体信息到read_msg_.body()
   void do_read_body()
   {
-    boost::asio::async_read(socket_,
+    unsigned generation = generation_;
+    transport_.async_read(
         boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
-        [this](boost::system::error_code ec, std::size_t /*length*/)
+        [this, generation](boost::system::error_code ec, std::size_t /*length*/)
         {
-          if (!ec)  //没出错，cout包体 
+          if (generation != generation_)
+            return;
+          if (!ec && read_msg_.compressed() && !decompress_read_msg())
+          {
+            reconnect(generation);  //无法解压，重新连接
+          }
+          else if (!ec)  //没出错，cout包体 
           {
-            std::cout.write(read_msg_.body(), read_msg_.body_length());
-            std::cout << "\n";
+            if (!handle_reply() && !duplicate())
+            {
+              std::cout.write(read_msg_.body(), read_msg_.body_length());
+              std::cout << "\n";
+            }
             do_read_header(); //继续读
           }
           else  //出错
           {
-            socket_.close();  //客户端关闭 //此处的close其实就是在run()线程下运行，没有问题，可直接调用close
+            reconnect(generation);  //关闭后重连 //此处就是在run()线程下运行，没有问题，可直接调用close
           }
         });
   }
+  bool decompress_read_msg()
+  {
+    chat_message plain;
+    if (!codec_ || !codec_->decompress(read_msg_, plain))
+      return false;
+    read_msg_ = plain;
+    return true;
+  }
+//处理服务器的回复和通知，返回true表示已处理，不显示
+//  /compress ...          对压缩请求的回复：同意后发出的消息也压缩
+//  /seq <聊天室> <编号>    接下来这个聊天室第一条消息的编号
+//  /token <令牌>          断线重连时用来接回会话的令牌，只认新会话加入前服务器直接回复的那条（紧跟着就是 /seq）
+//  /attach failed         会话已过期，改用 /resume 按编号恢复
+//  /resume <聊天室>        恢复的回复；带着错误原因时（如 too many rooms）改为恢复服务器放进去的默认聊天室
+//  /ping                  服务器探测连接是否还活着，回复 /pong
+//  /sub <条件>...         当前订阅的过滤条件，重连后原样再订阅一次
+//  /nick <用户名>         当前的用户名，/watch <用户名>... 当前关注的用户，重连后同样再发一次
+  bool handle_reply()
+  {
+    std::string body(read_msg_.body(), read_msg_.body_length());
+    std::istringstream in(body);
+    std::string command;
+    in >> command;
+    bool expect_token = expect_token_;
+    if (command != "/attach" && command != "/compress")//令牌之前只可能有这两种回复
+      expect_token_ = false;
+    if (command == "/token" && expect_token)
+    {
+      in >> token_;
+      return true;
+    }
+    if (command == "/seq")
+    {
+      std::string room;
+      std::uint64_t seq = 0;
+      in >> room >> seq;
+      bool welcome = !welcomed_;//新会话的第一条编号通知来自服务器放进去的默认聊天室，可能与要恢复的同名
+      welcomed_ = true;
+      if (!resuming_.empty() && (welcome || room != resuming_))
+      {
+        default_room_ = room;//重连后默认聊天室的通知，等 /resume 的
+        return true;
+      }
+      if (!resuming_.empty() && seq <= shown_seq_[room])
+        shown_seq_[room] = seq - 1;//服务器重启过或聊天室回收过，编号重新开始，之前显示的编号作废
+      resuming_.clear();
+      room_ = room;
+      next_seq_ = seq;
+      return true;
+    }
+    if (command == "/resume" && !resuming_.empty() && body != "/resume " + resuming_
+        && !default_room_.empty())
+    {
+      room_ = default_room_;//恢复失败，留在默认聊天室，从头回放它
+      write(resume_message());
+      return false;
+    }
+    if (command == "/ping")
+    {
+      write(make_message("/pong"));
+      return true;
+    }
+    if (command == "/attach")
+    {
+      token_.clear();
+      if (!nick_.empty())
+        write(make_message("/nick " + nick_));
+      if (!watching_.empty())
+        write(make_message("/watch" + watching_));
+      if (!filters_.empty())
+        write(make_message("/sub" + filters_));
+      if (!room_.empty())
+        write(resume_message());
+      return true;
+    }
+    if (command == "/sub")
+    {
+      filters_ = body.substr(command.size());
+      return false;//显示出来，让用户知道当前订阅了什么
+    }
+    if (command == "/nick")
+    {
+      std::string name, extra;
+      if (in >> name && !(in >> extra))//"/nick invalid name" 不是用户名
+        nick_ = name;
+      return false;
+    }
+    if (command == "/watch")
+    {
+      watching_ = body.substr(command.size());
+      return false;
+    }
+    if (!codec_ || command != "/compress")
+      return false;
+    compress_ = (body != "/compress off");
+    return true;
+  }
+//聊天室消息按编号计数，重连后服务器重发的、已经显示过的消息跳过；命令回复、私信和在线状态不计数
+  bool duplicate()
+  {
+    std::string body(read_msg_.body(), read_msg_.body_length());
+    std::string command = body.substr(0, body.find(' '));
+    if (command == "/join" || command == "/resume" || command == "/compress" || command == "/sub"
+        || command == "/nick" || command == "/watch" || command == "/msg" || command == "/presence")
+      return false;
+    if (!resuming_.empty())//还没恢复到原来的聊天室
+      return true;
+    std::uint64_t seq = next_seq_++;
+    std::uint64_t& shown = shown_seq_[room_];
+    if (seq <= shown)
+      return true;
+    shown = seq;
+    return false;
+  }
 //异步写
   void do_write()
   {
-    boost::asio::async_write(socket_,
+    unsigned generation = generation_;
+    transport_.async_write(
         boost::asio::buffer(write_msgs_.front().data(),
           write_msgs_.front().length()),
-        [this](boost::system::error_code ec, std::size_t /*length*/)
+        [this, generation](boost::system::error_code ec, std::size_t /*length*/)
         {
+          if (generation != generation_)
+            return;
           if (!ec)  //没出错
           {
             write_msgs_.pop_front();  //去除消息队列的第一条消息
@@ -122,36 +401,120 @@ private:
               do_write(); //继续写
             }
           }
-          else  //出错
+          else  //出错，未写完的消息留在队列中，重连后再发
           {
-            socket_.close();  //关闭连接
+            reconnect(generation);
           }
         });
   }
 
 private:
   boost::asio::io_context& io_context_; //chat_session此处为chat_room
-  tcp::socket socket_;
+  std::vector<endpoint_type> endpoints_;
+  std::string host_;
+  std::unique_ptr<boost::asio::ssl::context> tls_context_;//必须比transport_先构造、后析构
+  chat_transport transport_;
+  std::string tls_session_;
+  bool connected_ = false;
+  bool closing_ = false;//用户结束输入，不再重连
+  unsigned generation_ = 0;//每次连接或断开时加一
+  boost::asio::steady_timer retry_timer_;
+  std::chrono::seconds backoff_ = std::chrono::seconds(1);
+  std::string token_;//服务器给的恢复令牌，没有开启断线恢复时为空
+  bool expect_token_ = false;//连接上还没收到别的消息，此时的 /token 才是给本会话的
+  std::string room_;//当前聊天室，由服务器的编号通知得知
+  std::string resuming_;//已发出 /resume、还没收到编号通知的聊天室，为空表示不在恢复中
+  std::string default_room_;//恢复期间服务器放进去的默认聊天室
+  bool welcomed_ = false;//这个连接上收到过编号通知
+  std::string filters_;//服务器回复的订阅条件（带前导空格），为空表示接收所有消息
+  std::string nick_;//服务器确认的用户名
+  std::string watching_;//服务器回复的关注列表（带前导空格）
+  std::uint64_t next_seq_ = 1;//下一条收到的消息的编号
+  std::map<std::string, std::uint64_t> shown_seq_;//每个聊天室已显示的最后一条消息的编号
   //read_msg_和write_msgs_使用默认构造函数
   chat_message read_msg_;
   chat_message_queue write_msgs_;
+  std::unique_ptr<deflate_codec> codec_;//为空表示不使用压缩
+  bool compress_ = false;//服务器是否已同意压缩
 };
 
+//共享内存生产者：从标准输入按行读消息，写进服务器--shm=ROOM:FILE映射的环
+//环满时稍等再试，不丢消息；服务器不处理以/开头的命令，这种行也照常写入，由服务器丢弃
+int feed_shm(const std::string& path, std::size_t size)
+{
+  shm_ring ring(path, size);
+  char line[chat_message::max_body_length + 1];
+  while (std::cin.getline(line, chat_message::max_body_length + 1))
+  {
+    chat_message msg;
+    msg.body_length(std::strlen(line));
+    std::memcpy(msg.body(), line, msg.body_length());
+    msg.encode_header();
+    while (!ring.push(msg))
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  return 0;
+}
+
 int main(int argc, char* argv[])
 {
   try
   {
-    if (argc != 3)
+    //同一台机器上可以用Unix域socket连接：chat_client unix:PATH 或 unix:@NAME（抽象命名空间），不用给端口
+    bool local = argc > 1 && std::string(argv[1]).compare(0, 5, "unix:") == 0;
+    //或者直接写服务器的共享内存输入：chat_client shm:FILE，只发不收
+    bool shm = argc > 1 && std::string(argv[1]).compare(0, 4, "shm:") == 0;
+    if (argc < (local || shm ? 2 : 3))
     {
-      std::cerr << "Usage: chat_client <host> <port>\n";
+      std::cerr << "Usage: chat_client <host> <port> [--compress] [--dict=FILE]"
+        " [--tls] [--ca=FILE] [--insecure] [--tls-session=FILE]\n"
+        "       chat_client unix:PATH|unix:@NAME [--compress] [--dict=FILE]\n"
+        "       chat_client shm:FILE [--shm-size=N]\n";
       return 1;
     }
 
+    client_options options;
+    for (int i = local || shm ? 2 : 3; i < argc; ++i)
+    {
+      std::string arg = argv[i];
+      if (arg == "--compress")
+        options.compress = true;
+      else if (arg.compare(0, 7, "--dict=") == 0)
+        options.dictionary = arg.substr(7);
+      else if (arg == "--tls")
+        options.tls = true;
+      else if (arg.compare(0, 5, "--ca=") == 0)
+        options.ca_file = arg.substr(5);
+      else if (arg == "--insecure")
+        options.insecure = true;
+      else if (arg.compare(0, 14, "--tls-session=") == 0)
+        options.tls_session = arg.substr(14);
+      else if (arg.compare(0, 11, "--shm-size=") == 0)
+        options.shm_size = static_cast<std::size_t>(std::max(1, std::atoi(arg.c_str() + 11)));
+      else
+      {
+        std::cerr << "Unknown option: " << arg << "\n";
+        return 1;
+      }
+    }
+
+    if (shm)
+      return feed_shm(argv[1] + 4, options.shm_size);
+
     boost::asio::io_context io_context;
 
-    tcp::resolver resolver(io_context);
-    auto endpoints = resolver.resolve(argv[1], argv[2]);
-    chat_client c(io_context, endpoints); //异步连接对应的服务器，而真正连接服务器的时刻是在run()中
+    std::vector<chat_client::endpoint_type> endpoints;
+    if (local)
+    {
+      endpoints.push_back(unix_endpoint(argv[1] + 5));
+    }
+    else
+    {
+      tcp::resolver resolver(io_context);
+      for (const auto& entry: resolver.resolve(argv[1], argv[2]))
+        endpoints.push_back(entry.endpoint());
+    }
+    chat_client c(io_context, endpoints, argv[1], options); //异步连接对应的服务器，而真正连接服务器的时刻是在run()中
     //单独开一个线程跑io_context.run()
     std::thread t([&io_context](){ io_context.run(); });
     //主线程等待客户输入
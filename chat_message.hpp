@@ -16,14 +16,18 @@
 #include <cstring>
 
 // s -> c , c -> s message {header, body} //header length 一般定长
+// 普通消息包头为"%4d"，包体不超过512字节，所以第一个字节总是空格
+// 压缩过的消息包头第一个字节为'z'，后三个字节为压缩后包体长度，只发给协商过压缩的一端
 class chat_message
 {
 public:
   enum { header_length = 4 };
   enum { max_body_length = 512 };
+  enum { compressed_marker = 'z' };
 
   chat_message()
-    : body_length_(0)
+    : body_length_(0),
+      compressed_(false)
   {
   }
 //读取内容，返回信息头部地址
@@ -63,11 +67,25 @@ public:
     if (body_length_ > max_body_length)
       body_length_ = max_body_length;
   }
+//包体是否为压缩数据
+  bool compressed() const
+  {
+    return compressed_;
+  }
+
+  void compressed(bool value)
+  {
+    compressed_ = value;
+  }
 //解析包头
   bool decode_header()
   {
     char header[header_length + 1] = "";//多一位保存'\0'
-    std::strncat(header, data_, header_length);//将data_的前四个字节放到header里来
+    compressed_ = (data_[0] == compressed_marker);
+    if (compressed_)//跳过标记，只取后三个字节的长度
+      std::strncat(header, data_ + 1, header_length - 1);
+    else
+      std::strncat(header, data_, header_length);//将data_的前四个字节放到header里来
     body_length_ = std::atoi(header);//包头存储的是包体长度
     if (body_length_ > max_body_length)//包体长度不合法
     {
@@ -80,13 +98,17 @@ public:
   void encode_header()
   {
     char header[header_length + 1] = "";
-    std::sprintf(header, "%4d", static_cast<int>(body_length_));//将body_length_转换为4字节数字存于header中
+    if (compressed_)
+      std::sprintf(header, "%c%3d", compressed_marker, static_cast<int>(body_length_));
+    else
+      std::sprintf(header, "%4d", static_cast<int>(body_length_));//将body_length_转换为4字节数字存于header中
     std::memcpy(data_, header, header_length);
   }
 
 private:
   char data_[header_length + max_body_length];
   std::size_t body_length_;
+  bool compressed_;
 };
 
 #endif // CHAT_MESSAGE_HPP
\ No newline at end of file
@@ -8,22 +8,296 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <deque>
+#include <functional>
 #include <iostream>
 #include <list>
+#include <map>
 #include <memory>
+#include <queue>
 #include <set>
+#include <stdexcept>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 #include <boost/asio.hpp>
+#include <netinet/tcp.h>
+#include <openssl/rand.h>
+#include <sys/un.h>
+#include <unistd.h>
 #include "chat_message.hpp"
+#include "chat_transport.hpp"
+#include "compression.hpp"
+#include "cpu_placement.hpp"
+#include "handoff.hpp"
+#include "hash_ring.hpp"
+#include "member_set.hpp"
+#include "shm_ring.hpp"
+#include "timer_wheel.hpp"
+#include "token_bucket.hpp"
+#include "topic_index.hpp"
 
 using boost::asio::ip::tcp;
+using stream_protocol = boost::asio::generic::stream_protocol;//监听和客户端连接：TCP（IPv4/IPv6）或Unix域socket
+using stream_acceptor = boost::asio::basic_socket_acceptor<stream_protocol>;
 
 //----------------------------------------------------------------------
 
 using chat_message_queue = std::deque<chat_message>;
 
+//frame的编码方式
+//凡是可以被多个连接共享的变换（如用聊天室共用的字典压缩）都作为一种编码，每个frame每种编码只计算一次
+//只与单个连接有关的工作（如加密）留给chat_session自己做
+enum frame_encoding
+{
+  plain_encoding,
+  deflate_encoding,
+  encoding_count
+};
+
+//可被多个连接共享的待发数据：一条消息，或合并窗口内的多条消息(parts)
+//各种编码的结果缓存在frame中，分发和历史回放时只复制指针
+class chat_frame
+{
+public:
+  explicit chat_frame(const chat_message& msg)
+  {
+    encoded_[plain_encoding].assign(msg.data(), msg.length());
+    ready_[plain_encoding] = true;
+  }
+
+  explicit chat_frame(std::vector<std::shared_ptr<chat_frame>> parts)
+    : parts_(std::move(parts))
+  {
+  }
+//合并的各条消息，单条消息时为空
+  const std::vector<std::shared_ptr<chat_frame>>& parts() const
+  {
+    return parts_;
+  }
+
+  bool has(frame_encoding encoding) const
+  {
+    return ready_[encoding];
+  }
+//是否来自其他节点，来自其他节点的消息只分发给本地成员，不再转发
+  bool remote() const
+  {
+    return remote_;
+  }
+
+  void remote(bool value)
+  {
+    remote_ = value;
+  }
+//消息在聊天室中的编号，进入历史时确定，合并的frame本身没有编号
+  std::uint64_t seq() const
+  {
+    return seq_;
+  }
+
+  void seq(std::uint64_t value)
+  {
+    seq_ = value;
+  }
+
+  const std::string& data(frame_encoding encoding) const
+  {
+    return encoded_[encoding];
+  }
+
+  void set(frame_encoding encoding, std::string data)
+  {
+    encoded_[encoding] = std::move(data);
+    ready_[encoding] = true;
+  }
+
+private:
+  std::vector<std::shared_ptr<chat_frame>> parts_;
+  std::string encoded_[encoding_count];
+  bool ready_[encoding_count] = {};
+  bool remote_ = false;
+  std::uint64_t seq_ = 0;
+};
+
+using chat_frame_ptr = std::shared_ptr<chat_frame>;
+using chat_frame_queue = std::deque<chat_frame_ptr>;
+
+inline chat_frame_ptr make_frame(const chat_message& msg)
+{
+  return std::make_shared<chat_frame>(msg);
+}
+//服务器自己发给客户端的文本（命令回复、编号通知）
+inline chat_frame_ptr make_frame(const std::string& text)
+{
+  chat_message msg;
+  msg.body_length(text.size());
+  std::memcpy(msg.body(), text.data(), msg.body_length());
+  msg.encode_header();
+  return make_frame(msg);
+}
+//编号通知 /seq <聊天室> <编号>：告诉客户端接下来收到的这个聊天室的第一条消息的编号
+//客户端从这里开始对收到的消息计数，断线重连时用 /resume 带上最后收到的编号
+inline chat_frame_ptr seq_notice(const std::string& room, std::uint64_t seq)
+{
+  return make_frame("/seq " + room + " " + std::to_string(seq));
+}
+
+//----------------------------------------------------------------------
+//服务器配置，命令行中以 --name=value 的形式给出
+struct server_options
+{
+  int pending_accepts = 16;//每个监听端口同时挂起的async_accept数量
+  int listen_backlog = boost::asio::socket_base::max_listen_connections;//listen队列长度
+  int accept_batch = 64;//一次accept完成后，最多再非阻塞地取出多少个已就绪的连接
+  double msg_rate = 0;//每个连接每秒最多转发多少条消息，0为不限
+  double byte_rate = 0;//每个连接每秒最多转发多少字节
+  double ip_msg_rate = 0;//同一IP的所有连接合计
+  double ip_byte_rate = 0;
+  int coalesce_ms = 0;//合并窗口（毫秒），0为不合并，每条消息单独分发
+  int coalesce_bytes = 16384;//合并的数据达到这么多字节时立即分发
+  bool deflate = false;//是否允许客户端协商deflate压缩
+  std::string dictionary;//压缩用的预置字典文件，为空则不用字典
+  std::string tls_cert;//证书链文件，与tls_key都给出时所有端口使用TLS
+  std::string tls_key;
+  bool ktls = false;//握手后尝试把对称加密交给内核
+  int peer_port = 0;//接受其他节点连接的端口，0为不接受
+  std::vector<std::string> peers;//主动连接的其他节点 host:port，可以给多个
+  std::string node;//本节点在其他节点--peer中的写法，默认为127.0.0.1:<peer_port>
+  int vnodes = 128;//一致性哈希环上每个节点的虚拟节点数
+  std::vector<std::string> upstreams;//转发层模式：上游核心节点的--peer-port地址 host:port，可以给多个
+  int resume_grace = 0;//连接断开后暂存会话多少秒，等客户端带令牌重连，0为不暂存
+  int ping_interval = 0;//连续多少秒没收到客户端的数据就发 /ping，0为不发
+  int read_timeout = 0;//连续多少秒没收到客户端的数据就断开，0为不检查
+  int drain_timeout = 0;//收到SIGTERM/SIGINT后最多等多少秒让连接自行断开，0为一直等
+  std::string handoff;//在这个Unix域socket上等待新进程来接管（热升级），为空则不接受
+  std::string takeover;//启动时从这个Unix域socket接管旧进程的监听socket、聊天室历史和连接
+  bool busy_poll = false;//事件循环有事可做时一直poll()，连续空转一段时间后退回阻塞等待
+  int busy_poll_us = 0;//客户端socket的SO_BUSY_POLL（微秒），0为不设置
+  int cpu = -1;//把事件循环线程绑定到这个CPU，-1为不绑定
+  std::string numa_node;//NUMA节点编号或网卡名：整个进程绑定到该节点的CPU，内存策略设为MPOL_PREFERRED该节点
+  bool reuse_port = false;//监听socket设置SO_REUSEPORT，多个进程（如每个NUMA节点一个）监听同一端口
+  bool nodelay = true;//客户端连接关闭Nagle算法，小消息不等前一段的ACK
+  int sndbuf = 0;//客户端连接的SO_SNDBUF/SO_RCVBUF（字节），0为由内核自动调整
+  int rcvbuf = 0;
+  int notsent_lowat = 0;//TCP_NOTSENT_LOWAT（字节）：内核里还没发出的数据多于这些时不再收，0为不设置
+  bool cork = false;//写队列里还有下一批时设置TCP_CORK，写空了再放开，让内核只发满的报文段
+  std::vector<std::string> shm_rings;//共享内存输入 <聊天室>:<文件>，可以给多个，每个文件一个生产者
+  int shm_size = 1 << 20;//每个环形缓冲区的数据区字节数，生产者必须用同样的值
+  int shm_poll_us = 200;//环形缓冲区空着时隔多久再看一次（微秒）
+  int presence_ms = 250;//在线状态的合并窗口（毫秒），0为每次变化立即通知
+  int max_rooms = 10000;//客户端用 /join、/resume 最多能让本节点同时有多少个聊天室有成员，0为不限
+  int room_linger = 60;//没有成员的聊天室（连同历史）保留多少秒后回收
+};
+
+//解析单个选项，不认识的选项返回false
+bool parse_option(const std::string& arg, server_options& options)
+{
+  std::string::size_type pos = arg.find('=');
+  if (arg.compare(0, 2, "--") != 0 || pos == std::string::npos)
+    return false;
+
+  std::string name = arg.substr(2, pos - 2);
+  std::string value = arg.substr(pos + 1);
+  if (name == "accepts")
+    options.pending_accepts = std::max(1, std::atoi(value.c_str()));
+  else if (name == "backlog")
+    options.listen_backlog = std::atoi(value.c_str());
+  else if (name == "accept-batch")
+    options.accept_batch = std::max(1, std::atoi(value.c_str()));
+  else if (name == "msg-rate")
+    options.msg_rate = std::atof(value.c_str());
+  else if (name == "byte-rate")
+    options.byte_rate = std::atof(value.c_str());
+  else if (name == "ip-msg-rate")
+    options.ip_msg_rate = std::atof(value.c_str());
+  else if (name == "ip-byte-rate")
+    options.ip_byte_rate = std::atof(value.c_str());
+  else if (name == "coalesce-ms")
+    options.coalesce_ms = std::atoi(value.c_str());
+  else if (name == "coalesce-bytes")
+    options.coalesce_bytes = std::max(1, std::atoi(value.c_str()));
+  else if (name == "deflate")
+    options.deflate = std::atoi(value.c_str()) != 0;
+  else if (name == "dict")
+    options.dictionary = value;
+  else if (name == "tls-cert")
+    options.tls_cert = value;
+  else if (name == "tls-key")
+    options.tls_key = value;
+  else if (name == "ktls")
+    options.ktls = std::atoi(value.c_str()) != 0;
+  else if (name == "peer-port")
+    options.peer_port = std::atoi(value.c_str());
+  else if (name == "peer")
+    options.peers.push_back(value);
+  else if (name == "node")
+    options.node = value;
+  else if (name == "vnodes")
+    options.vnodes = std::max(1, std::atoi(value.c_str()));
+  else if (name == "upstream")
+    options.upstreams.push_back(value);
+  else if (name == "resume-grace")
+    options.resume_grace = std::atoi(value.c_str());
+  else if (name == "ping-interval")
+    options.ping_interval = std::atoi(value.c_str());
+  else if (name == "read-timeout")
+    options.read_timeout = std::atoi(value.c_str());
+  else if (name == "drain-timeout")
+    options.drain_timeout = std::atoi(value.c_str());
+  else if (name == "handoff")
+    options.handoff = value;
+  else if (name == "takeover")
+    options.takeover = value;
+  else if (name == "busy-poll")
+    options.busy_poll = std::atoi(value.c_str()) != 0;
+  else if (name == "busy-poll-us")
+    options.busy_poll_us = std::atoi(value.c_str());
+  else if (name == "cpu")
+    options.cpu = std::atoi(value.c_str());
+  else if (name == "numa-node")
+    options.numa_node = value;
+  else if (name == "reuse-port")
+    options.reuse_port = std::atoi(value.c_str()) != 0;
+  else if (name == "nodelay")
+    options.nodelay = std::atoi(value.c_str()) != 0;
+  else if (name == "sndbuf")
+    options.sndbuf = std::atoi(value.c_str());
+  else if (name == "rcvbuf")
+    options.rcvbuf = std::atoi(value.c_str());
+  else if (name == "notsent-lowat")
+    options.notsent_lowat = std::atoi(value.c_str());
+  else if (name == "cork")
+    options.cork = std::atoi(value.c_str()) != 0;
+  else if (name == "shm")
+    options.shm_rings.push_back(value);
+  else if (name == "shm-size")
+    options.shm_size = std::max(1, std::atoi(value.c_str()));
+  else if (name == "shm-poll-us")
+    options.shm_poll_us = std::max(1, std::atoi(value.c_str()));
+  else if (name == "presence-ms")
+    options.presence_ms = std::atoi(value.c_str());
+  else if (name == "max-rooms")
+    options.max_rooms = std::atoi(value.c_str());
+  else if (name == "room-linger")
+    options.room_linger = std::max(0, std::atoi(value.c_str()));
+  else
+    return false;
+  return true;
+}
+
 //----------------------------------------------------------------------
 //聊天基类
 class chat_participant
@@ -31,210 +305,3519 @@ class chat_participant
 public:
   using pointer = std::shared_ptr<chat_participant>;
   virtual ~chat_participant() {}
-  virtual void deliver(const chat_message& msg) = 0;//纯虚函数无法实例化
+  virtual void deliver(const chat_frame_ptr& frame) = 0;//纯虚函数无法实例化
+  virtual frame_encoding encoding() const { return plain_encoding; }//希望收到的编码
+  virtual bool remote() const { return false; }//是否代表其他节点，而不是本地客户端
+  virtual void history_restarted() {}//聊天室历史从归属节点的编号重新开始，旧编号不再指向原来的消息
+  enum : std::uint32_t { no_member = 0xffffffff };
+  std::uint32_t member_id() const { return member_id_; }//成员编号，不在任何聊天室中时为no_member
+
+private:
+  friend class member_table;
+  std::uint32_t member_id_ = no_member;
+};
+
+using chat_participant_ptr = std::shared_ptr<chat_participant>;
+
+//成员编号表：成员加入第一个聊天室时分配编号，离开最后一个聊天室时收回，聊天室的成员集合和过滤索引都按编号存
+//收回的编号优先复用最小的，编号保持稠密，成员集合的块就少
+//表中持有成员的智能指针，成员离开最后一个聊天室时随之释放
+class member_table
+{
+public:
+//返回成员的编号，每加入一个聊天室调用一次
+  std::uint32_t enter(const chat_participant_ptr& participant)
+  {
+    std::uint32_t& id = participant->member_id_;
+    if (id == chat_participant::no_member)
+    {
+      if (free_.empty())
+      {
+        id = static_cast<std::uint32_t>(members_.size());
+        members_.emplace_back();
+        rooms_.push_back(0);
+      }
+      else
+      {
+        id = free_.top();
+        free_.pop();
+      }
+      members_[id] = participant;
+    }
+    ++rooms_[id];
+    return id;
+  }
+//每离开一个聊天室调用一次，调用方须另外持有participant
+  void exit(chat_participant& participant)
+  {
+    std::uint32_t id = participant.member_id_;
+    if (id == chat_participant::no_member || --rooms_[id] > 0)
+      return;
+    participant.member_id_ = chat_participant::no_member;
+    members_[id].reset();
+    free_.push(id);
+  }
+
+  const chat_participant_ptr& operator[](std::uint32_t id) const
+  {
+    return members_[id];
+  }
+
+private:
+  std::vector<chat_participant_ptr> members_;
+  std::vector<unsigned> rooms_;//各编号的成员在几个聊天室中
+  std::priority_queue<std::uint32_t, std::vector<std::uint32_t>,
+    std::greater<std::uint32_t>> free_;
+};
+
+//----------------------------------------------------------------------
+//聊天室与节点互联之间的回调，由chat_hall持有，所有聊天室共用
+struct room_hooks
+{
+//本地成员从无到有、从有到无时调用，节点间据此订阅或退订聊天室
+  std::function<void(const std::string& room, bool active)> on_interest;
+//本地客户端发出的消息先交给它：聊天室归属其他节点时转交过去由归属节点排序，返回true；
+//归属本节点（或联系不上归属节点）时返回false，由本地直接分发
+  std::function<bool(const std::string& room, const chat_message& msg)> route;
+//成员（本地的和订阅的节点）从无到有、从有到无时调用，大厅据此计数，空了一段时间后回收
+  std::function<void(const std::string& room, bool occupied)> on_occupied;
+};
+
+//聊天室类
+//由大厅和当前所在的会话共同持有：大厅回收空聊天室时，刚离开的会话可能还有回调在用它
+class chat_room : public std::enable_shared_from_this<chat_room>
+{
+public:
+//codec为共用的压缩器，没有开启压缩时为空；table为大厅的成员编号表，所有聊天室共用
+  chat_room(boost::asio::io_context& io_context, const server_options& options,
+      const std::string& name, deflate_codec* codec, const room_hooks& hooks,
+      member_table& table)
+    : io_context_(io_context),
+      table_(table),
+      name_(name),
+      coalesce_window_(options.coalesce_ms),
+      coalesce_bytes_(options.coalesce_bytes),
+      coalesce_timer_(io_context),
+      codec_(codec),
+      hooks_(hooks)
+  {
+  }
+
+  const std::string& name() const
+  {
+    return name_;
+  }
+
+  deflate_codec* codec()
+  {
+    return codec_;
+  }
+//成员更换编码时调用，分发前只预先计算有成员在用的编码
+  void change_encoding(chat_participant_ptr participant, frame_encoding from)
+  {
+    if (is_member(*participant))
+    {
+      --encoding_users_[from];
+      ++encoding_users_[participant->encoding()];
+    }
+  }
+//取frame的某种编码，还没有时计算一次并缓存在frame中，之后所有成员共享
+//合并的frame由各条消息的编码拼接而成，各条消息的编码同样会缓存下来供历史回放使用
+  const std::string& encoded(chat_frame& frame, frame_encoding encoding)
+  {
+    if (!frame.has(encoding))
+    {
+      std::string data;
+      if (frame.parts().empty())
+        data = transform(frame.data(plain_encoding), encoding);
+      else
+        for (const auto& part: frame.parts())
+          data += encoded(*part, encoding);
+      frame.set(encoding, std::move(data));
+    }
+    return frame.data(encoding);
+  }
+//加入聊天室只登记成员，历史消息由成员自己按发送进度从history()中逐条拉取
+//避免大量客户端同时重连时join一次性把历史消息全部塞进写队列
+  void join(chat_participant_ptr participant)
+  {
+    if (is_member(*participant))
+      return;
+    std::uint32_t id = table_.enter(participant);
+    members_.add(id);
+    broadcast_.add(id);
+    if (members_.size() == 1 && hooks_.on_occupied)
+      hooks_.on_occupied(name_, true);
+    ++encoding_users_[participant->encoding()];
+    if (!participant->remote() && ++local_members_ == 1 && hooks_.on_interest)
+      hooks_.on_interest(name_, true);
+  }
+//将客户从成员集合中去除，离开最后一个聊天室时编号表中的智能指针随之释放，会自动析构
+  void leave(chat_participant_ptr participant)
+  {
+    if (!is_member(*participant))
+      return;
+    std::uint32_t id = participant->member_id();
+    members_.remove(id);
+    broadcast_.remove(id);
+    release_filter(id);
+    --encoding_users_[participant->encoding()];
+    if (!participant->remote() && --local_members_ == 0 && hooks_.on_interest)
+      hooks_.on_interest(name_, false);
+    table_.exit(*participant);
+    if (members_.empty())
+    {
+      ++vacated_;
+      if (hooks_.on_occupied)
+        hooks_.on_occupied(name_, false);
+    }
+  }
+//当前是否有本地成员
+  bool active() const
+  {
+    return local_members_ > 0;
+  }
+//监听端口的默认聊天室和共享内存输入的聊天室一直被引用着，固定下来不回收
+  chat_room& pin()
+  {
+    pinned_ = true;
+    return *this;
+  }
+//可以回收：没有本地成员和订阅的节点，也没有待分发的消息和未完成的定时器
+//历史消息随之丢弃，再次创建时编号从1开始，带着旧编号 /resume 的客户端收到 /seq <聊天室> 1 后重新计数
+  bool idle() const
+  {
+    return !pinned_ && members_.empty() && pending_.empty()
+      && batch_msgs_.empty() && coalesce_waits_ == 0;
+  }
+//成员走空的次数，回收前据此确认期间没有人来过又走
+  std::uint64_t vacated() const
+  {
+    return vacated_;
+  }
+//历史消息编号区间[history_begin(), history_end())
+  std::uint64_t history_begin() const
+  {
+    return history_end_ - recent_msgs_.size();
+  }
+
+  std::uint64_t history_end() const
+  {
+    return history_end_;
+  }
+//最后收到的归属节点消息的下一个编号，0表示没有收到过（本节点是归属节点，或者还没有订阅到）
+//本地历史可能夹着连接断开期间改为本地分发的消息，向归属节点续订要用这个编号
+  std::uint64_t owner_end() const
+  {
+    return owner_end_;
+  }
+//取编号为seq的历史消息，seq必须在上述区间内
+  const chat_frame_ptr& history(std::uint64_t seq) const
+  {
+    return recent_msgs_[seq - history_begin()];
+  }
+//热升级时接过旧进程的历史，编号不变，msgs中最后一条的编号为end-1
+  void restore_history(std::uint64_t end, std::uint64_t owner_end,
+      const std::vector<chat_frame_ptr>& msgs)
+  {
+    owner_end_ = owner_end;
+    recent_msgs_.assign(msgs.begin(), msgs.end());
+    while (recent_msgs_.size() > max_recent_msgs)
+      recent_msgs_.pop_front();
+    history_end_ = std::max<std::uint64_t>(end, recent_msgs_.size() + 1);
+    std::uint64_t seq = history_begin();
+    for (auto& msg: recent_msgs_)
+      msg->seq(seq++);
+  }
+
+//成员编号的集合，编号对应的成员在大厅的编号表中
+  const member_set& members() const
+  {
+    return members_;
+  }
+//把成员的过滤条件整体换成filters（必须都是topic_index::valid()的），之后只收到匹配任一条件的消息；为空时恢复接收全部消息
+//next为客户端接下来期望的编号，0表示沿用：刚开始过滤的成员之前的消息都已排进写队列，从history_end()算起
+//跳过的消息造成编号不连续时，先给成员发编号通知，客户端的计数和断线后的 /resume 照常有效
+  void filter(const chat_participant_ptr& participant, const std::set<std::string>& filters,
+      std::uint64_t next = 0)
+  {
+    if (!is_member(*participant))
+      return;
+    std::uint32_t id = participant->member_id();
+    auto it = filter_states_.find(id);
+    if (filters.empty())
+    {
+      if (it != filter_states_.end() && it->second.next != history_end_)
+        participant->deliver(seq_notice(name_, history_end_));
+      release_filter(id);
+      return;
+    }
+
+    if (it == filter_states_.end())
+    {
+      it = filter_states_.emplace(id, filter_state()).first;
+      it->second.next = history_end_;
+      broadcast_.remove(id);
+    }
+    filter_state& entry = it->second;
+    for (const auto& old: entry.filters)
+      if (!filters.count(old))
+        index_.remove(id, old);
+    for (const auto& added: filters)
+      if (!entry.filters.count(added))
+        index_.add(id, added);
+    entry.filters = filters;
+    if (next != 0)
+      entry.next = next;
+  }
+//成员接下来期望的编号，没有过滤时为0
+  std::uint64_t filter_next(const chat_participant_ptr& participant) const
+  {
+    auto it = filter_states_.find(participant->member_id());
+    return it == filter_states_.end() ? 0 : it->second.next;
+  }
+//热升级交出连接之前调用：把合并窗口里攒的和正在分片分发的消息同步分发完，交出的会话不会漏掉
+//调用后不再运行事件循环，已post出去的分片不会再执行
+  void flush()
+  {
+    coalesce_timer_.cancel();
+    flush_batch();
+    while (!pending_.empty())
+    {
+      if (fanout_targets_.empty())
+      {
+        start_fanout();
+        if (pending_.empty())
+          break;
+      }
+      for (; fanout_next_ < fanout_targets_.size(); ++fanout_next_)
+        if (is_member(*fanout_targets_[fanout_next_]))
+          fanout_targets_[fanout_next_]->deliver(pending_.front());
+      fanout_targets_.clear();
+      pending_.pop_front();
+    }
+  }
+//消息先进入待分发队列，按顺序逐条分发，保证每个成员收到的消息顺序一致
+//开启合并时先攒在batch_中，窗口到期或攒够字节数后作为一次分发
+//remote为true表示消息由其他节点转发而来，seq为归属节点给它的编号（0表示不知道）
+  void deliver(const chat_message& msg, bool remote = false, std::uint64_t seq = 0)
+  {
+    if (!remote && hooks_.route && hooks_.route(name_, msg))
+      return;//已交给归属节点，等它排好序转发回来再分发
+
+    chat_frame_ptr frame = make_frame(msg);
+    frame->remote(remote);
+    frame->seq(seq);
+    if (coalesce_window_.count() <= 0)
+    {
+      enqueue(frame);
+      return;
+    }
+
+    if (seq != 0 && !batch_msgs_.empty() && batch_msgs_.back()->seq() + 1 != seq)
+    {
+      coalesce_timer_.cancel();//编号接不上，之前攒的先分发，同一个frame里的编号总是连续的
+      flush_batch();
+    }
+
+    batch_bytes_ += msg.length();
+    batch_msgs_.push_back(frame);
+    if (batch_bytes_ >= coalesce_bytes_)
+    {
+      coalesce_timer_.cancel();
+      flush_batch();
+    }
+    else if (batch_msgs_.size() == 1)//窗口从第一条消息开始计时
+    {
+      //cancel()拦不住已经到期、排进队列的回调，它可能在下一批开始后才执行，用批次号认出来
+      std::uint64_t generation = batch_generation_;
+      coalesce_timer_.expires_after(coalesce_window_);
+      ++coalesce_waits_;
+      coalesce_timer_.async_wait(
+          [this, generation](boost::system::error_code ec)
+          {
+            --coalesce_waits_;
+            if (!ec && generation == batch_generation_)
+              flush_batch();
+          });
+    }
+  }
+
+private:
+  struct filter_state
+  {
+    std::set<std::string> filters;
+    std::uint64_t next = 0;//客户端期望的下一条编号
+  };
+
+  bool is_member(const chat_participant& participant) const
+  {
+    return participant.member_id() != chat_participant::no_member
+      && members_.contains(participant.member_id());
+  }
+//去掉成员的过滤条件，仍在聊天室中的回到广播之列
+  void release_filter(std::uint32_t id)
+  {
+    auto it = filter_states_.find(id);
+    if (it == filter_states_.end())
+      return;
+    for (const auto& filter: it->second.filters)
+      index_.remove(id, filter);
+    filter_states_.erase(it);
+    if (members_.contains(id))
+      broadcast_.add(id);
+  }
+//把frame中的每条消息分别交给过滤条件匹配的成员，合并的frame拆开按条发
+  void deliver_filtered(const chat_frame_ptr& frame)
+  {
+    if (filter_states_.empty())
+      return;
+    if (frame->parts().empty())
+      deliver_matching(frame);
+    for (const auto& part: frame->parts())
+      deliver_matching(part);
+  }
+
+  void deliver_matching(const chat_frame_ptr& msg)
+  {
+    const std::string& data = msg->data(plain_encoding);
+    index_.match(data.data() + chat_message::header_length,
+        data.size() - chat_message::header_length, matched_);
+    matched_.for_each(
+        [this, &msg](std::uint32_t id)
+        {
+          filter_state& entry = filter_states_[id];
+          const chat_participant_ptr& member = table_[id];
+          if (entry.next != msg->seq())
+            member->deliver(seq_notice(name_, msg->seq()));
+          entry.next = msg->seq() + 1;
+          member->deliver(msg);
+        });
+  }
+//对单条消息做一种编码，压缩没有收益时就用原消息
+  std::string transform(const std::string& plain, frame_encoding encoding)
+  {
+    if (encoding == deflate_encoding && codec_)
+    {
+      chat_message msg, compressed;
+      std::memcpy(msg.data(), plain.data(), plain.size());
+      msg.body_length(plain.size() - chat_message::header_length);
+      if (codec_->compress(msg, compressed))
+        return std::string(compressed.data(), compressed.length());
+    }
+    return plain;
+  }
+//分发之前把有成员在用的编码都算好，分发和写的过程中每个成员只取现成的数据
+  void prepare(chat_frame& frame)
+  {
+    for (int i = 0; i < encoding_count; ++i)
+      if (i == plain_encoding || encoding_users_[i] > 0)
+        encoded(frame, static_cast<frame_encoding>(i));
+  }
+//把攒下的消息拼成一个frame，每个成员一次写完
+  void flush_batch()
+  {
+    if (batch_msgs_.empty())
+      return;
+
+    chat_frame_ptr frame = std::make_shared<chat_frame>(std::move(batch_msgs_));
+    batch_msgs_.clear();
+    batch_bytes_ = 0;
+    ++batch_generation_;
+    enqueue(frame);
+  }
+
+  void enqueue(const chat_frame_ptr& frame)
+  {
+    pending_.push_back(frame);
+    if (pending_.size() == 1)//没有正在进行的分发
+      start_fanout();
+  }
+//消息在开始分发时才进入历史并获得编号，与成员快照同时发生，新成员不会既回放又收到同一条
+//其他节点转来的消息沿用归属节点的编号；接不上时（错过了消息，归属节点重启过，
+//或者断开期间本地分发过消息，本地编号已经和归属节点分叉）丢弃本地历史，从它的编号重新开始，返回true
+  bool push_history(const chat_frame_ptr& msg)
+  {
+    bool restarted = false;
+    bool owned = msg->remote() && msg->seq() != 0;
+    if (owned && (msg->seq() != history_end_
+          || (owner_end_ != 0 ? history_end_ != owner_end_ : !recent_msgs_.empty())))
+    {
+      recent_msgs_.clear();
+      history_end_ = msg->seq();
+      restarted = true;
+    }
+    msg->seq(history_end_);
+    recent_msgs_.push_back(msg);
+    ++history_end_;
+    if (owned)
+      owner_end_ = history_end_;
+    while (recent_msgs_.size() > max_recent_msgs)
+      recent_msgs_.pop_front();
+    return restarted;
+  }
+//编号不连续时，先告诉本地成员新的编号，客户端据此重新计数
+//还在回放的成员停止回放，它记下的区间是重新开始之前的编号
+  void announce_seq(std::uint64_t seq)
+  {
+    chat_frame_ptr notice = seq_notice(name_, seq);
+    members_.for_each(
+        [this, &notice](std::uint32_t id)
+        {
+          if (table_[id]->remote())
+            return;
+          table_[id]->history_restarted();
+          table_[id]->deliver(notice);
+        });
+    for (auto& entry: filter_states_)
+      entry.second.next = seq;
+  }
+//开始分发队首消息
+//成员较少时直接同步分发；成员很多时对成员做快照，分片分发，每片之间让出事件循环
+  void start_fanout()
+  {
+    while (!pending_.empty())
+    {
+      const chat_frame_ptr& frame = pending_.front();
+      prepare(*frame);
+      bool restarted = false;
+      if (frame->parts().empty())
+        restarted = push_history(frame);
+      for (const auto& msg: frame->parts())
+        restarted = push_history(msg) || restarted;
+      if (restarted)
+        announce_seq(frame->parts().empty() ? frame->seq() : frame->parts().front()->seq());
+      deliver_filtered(frame);
+
+      if (broadcast_.size() > fanout_slice)
+      {
+        //快照保证分发期间新加入的成员不会重复收到（它会从recent_msgs_中收到），
+        //也保证分发期间改了过滤条件的成员这一条仍然按快照时的状态收到；分发期间离开的成员不再发
+        fanout_targets_.clear();
+        broadcast_.for_each(
+            [this](std::uint32_t id) { fanout_targets_.push_back(table_[id]); });
+        fanout_next_ = 0;
+        do_fanout();
+        return;
+      }
+
+      broadcast_.for_each(
+          [this, &frame](std::uint32_t id) { table_[id]->deliver(frame); });
+      pending_.pop_front();
+    }
+  }
+//分发一片，未完成则post到io_context继续，让其他连接的读写有机会执行
+//快照里的成员可能在前几片之间离开了聊天室，再发给它，写失败时会把已经离开的会话又暂存起来
+  void do_fanout()
+  {
+    const chat_frame_ptr& frame = pending_.front();
+    std::size_t end = std::min<std::size_t>(
+        fanout_next_ + fanout_slice, fanout_targets_.size());
+    for (; fanout_next_ < end; ++fanout_next_)
+      if (is_member(*fanout_targets_[fanout_next_]))
+        fanout_targets_[fanout_next_]->deliver(frame);
+
+    if (fanout_next_ < fanout_targets_.size())
+    {
+      boost::asio::post(io_context_, [this]() { do_fanout(); });
+      return;
+    }
+
+    fanout_targets_.clear();
+    pending_.pop_front();
+    if (!pending_.empty())
+      boost::asio::post(io_context_, [this]() { start_fanout(); });
+  }
+
+  boost::asio::io_context& io_context_;
+  member_table& table_;
+  std::string name_;
+  member_set members_;
+  member_set broadcast_;//没有过滤条件的成员，每条消息都发给他们
+  std::size_t local_members_ = 0;
+  enum { max_recent_msgs = 100 };
+  chat_frame_queue recent_msgs_;
+  std::uint64_t history_end_ = 1;//下一条进入历史的消息编号，从1开始，0表示一条都没有收到
+  std::uint64_t owner_end_ = 0;//见owner_end()
+  enum { fanout_slice = 1024 };//每次最多分发给多少个成员
+  chat_frame_queue pending_;//待分发队列，队首为正在分发的
+  std::vector<chat_participant_ptr> fanout_targets_;
+  std::size_t fanout_next_ = 0;
+  std::chrono::milliseconds coalesce_window_;
+  std::size_t coalesce_bytes_;
+  boost::asio::steady_timer coalesce_timer_;
+  std::vector<chat_frame_ptr> batch_msgs_;//合并窗口内的消息
+  std::size_t batch_bytes_ = 0;
+  std::uint64_t batch_generation_ = 0;//每分发一批加一，见deliver()
+  int coalesce_waits_ = 0;//还没回调的合并定时，回调引用着聊天室，归零之前不能回收
+  bool pinned_ = false;//见pin()
+  std::uint64_t vacated_ = 0;//见vacated()
+  deflate_codec* codec_;
+  int encoding_users_[encoding_count] = {};
+  const room_hooks& hooks_;
+  topic_index index_;//过滤条件，按成员编号
+  std::unordered_map<std::uint32_t, filter_state> filter_states_;//有过滤条件的成员
+  member_set matched_;//匹配结果，重复使用
+};
+
+//----------------------------------------------------------------------
+
+class chat_session;
+
+//断线后暂存的会话，按恢复令牌索引
+//客户端在宽限期内带着令牌重连时接回原来的会话，它仍是聊天室成员，写队列里没发出去的消息接着发
+class session_parking
+{
+public:
+  explicit session_parking(int grace_seconds)
+    : grace_(grace_seconds)
+  {
+  }
+
+  bool enabled() const
+  {
+    return grace_.count() > 0;
+  }
+
+  std::chrono::seconds grace() const
+  {
+    return grace_;
+  }
+//生成一个新的令牌：16字节随机数的十六进制
+  static std::string issue()
+  {
+    unsigned char bytes[16];
+    if (RAND_bytes(bytes, sizeof(bytes)) != 1)
+      throw std::runtime_error("RAND_bytes failed");
+    static const char digits[] = "0123456789abcdef";
+    std::string token;
+    for (unsigned char b: bytes)
+    {
+      token += digits[b >> 4];
+      token += digits[b & 0xf];
+    }
+    return token;
+  }
+
+  void park(const std::string& token, std::shared_ptr<chat_session> session)
+  {
+    parked_[token] = std::move(session);
+  }
+//取走令牌对应的会话，没有（令牌无效或已过期）时返回空
+  std::shared_ptr<chat_session> claim(const std::string& token)
+  {
+    std::shared_ptr<chat_session> session;
+    auto it = parked_.find(token);
+    if (it != parked_.end())
+    {
+      session = std::move(it->second);
+      parked_.erase(it);
+    }
+    return session;
+  }
+
+  void remove(const std::string& token)
+  {
+    parked_.erase(token);
+  }
+
+private:
+  std::chrono::seconds grace_;
+  std::map<std::string, std::shared_ptr<chat_session>> parked_;
+};
+
+//----------------------------------------------------------------------
+
+enum presence_state
+{
+  presence_offline,
+  presence_online,
+  presence_typing
 };
 
-using chat_participant_ptr = std::shared_ptr<chat_participant>;
+inline const char* presence_name(presence_state state)
+{
+  static const char* const names[] = { "offline", "online", "typing" };
+  return names[state];
+}
+
+//用户目录：用户名（/nick）到在线会话的哈希索引，私信和在线状态都按用户名直接查表，不遍历聊天室
+//同一个用户可以同时有几个会话（几台设备），私信发给每一个，有一个在线就算在线
+//在线状态只发给关注了这个用户的会话（/watch），关注者按成员编号存在member_set中
+//状态变化先记下，合并窗口到期后每个用户只发一次最新的状态，与上次发出的相同就不发，频繁上下线不会变成通知风暴
+class user_directory
+{
+public:
+  user_directory(boost::asio::io_context& io_context, member_table& table,
+      timer_wheel& timers, int window_ms)
+    : table_(table),
+      timers_(timers),
+      window_(window_ms),
+      timer_(io_context)
+  {
+  }
+//会话以user的身份上线；announce为false时不通知关注者（热升级接过来的会话，关注者早已知道）
+  void add(const std::string& user, const chat_participant_ptr& session, bool announce = true)
+  {
+    user_entry& entry = users_[user];
+    entry.sessions.push_back(session);
+    if (announce)
+      changed(user);
+    else
+      entry.announced = current(entry);
+  }
+
+  void remove(const std::string& user, chat_participant* session, bool announce = true)
+  {
+    auto it = users_.find(user);
+    if (it == users_.end())
+      return;
+    user_entry& entry = it->second;
+    entry.sessions.erase(std::remove_if(entry.sessions.begin(), entry.sessions.end(),
+          [session](const chat_participant_ptr& p) { return p.get() == session; }),
+        entry.sessions.end());
+    if (entry.sessions.empty())
+      entry.typing_until = 0;
+    if (announce)
+    {
+      changed(user);
+      return;
+    }
+    entry.announced = current(entry);
+    sweep(it);
+  }
+//用户的所有会话，不在线时返回空
+  const std::vector<chat_participant_ptr>* sessions(const std::string& user) const
+  {
+    auto it = users_.find(user);
+    return it == users_.end() || it->second.sessions.empty() ? nullptr : &it->second.sessions;
+  }
+//用户正在输入；typing_timeout_ms内没有再次调用，或者调用了typing(user, false)后恢复为在线
+  void typing(const std::string& user, bool active)
+  {
+    auto it = users_.find(user);
+    if (it == users_.end() || it->second.sessions.empty())
+      return;
+    user_entry& entry = it->second;
+    bool was_typing = entry.typing_until != 0;
+    std::uint64_t timeout = timers_.ticks(std::chrono::milliseconds(typing_timeout_ms));
+    entry.typing_until = active ? timers_.now() + timeout : 0;
+    if (active == was_typing)
+      return;
+    if (active)
+      timers_.schedule(timeout, [this, user]() { check_typing(user); });
+    changed(user);
+  }
+//watcher（成员编号）关注user，返回当前状态作为关注者的初始状态
+//合并窗口内正在变化的用户，记下给新关注者的状态，窗口到期时不再重复发给它
+  presence_state watch(const std::string& user, std::uint32_t watcher)
+  {
+    user_entry& entry = users_[user];
+    entry.watchers.add(watcher);
+    presence_state state = current(entry);
+    if (state != entry.announced)
+      entry.sent[watcher] = state;
+    else
+      entry.sent.erase(watcher);
+    return state;
+  }
+
+  void unwatch(const std::string& user, std::uint32_t watcher)
+  {
+    auto it = users_.find(user);
+    if (it == users_.end())
+      return;
+    it->second.watchers.remove(watcher);
+    it->second.sent.erase(watcher);
+    sweep(it);
+  }
+
+private:
+  struct user_entry
+  {
+    std::vector<chat_participant_ptr> sessions;
+    member_set watchers;
+    std::uint64_t typing_until = 0;//正在输入时为到期的tick，否则为0
+    presence_state announced = presence_offline;//最近一次发给关注者的状态
+    std::unordered_map<std::uint32_t, presence_state> sent;//合并窗口内新关注的成员收到的状态，与announced不同
+  };
+
+  using user_map = std::unordered_map<std::string, user_entry>;
+
+  static presence_state current(const user_entry& entry)
+  {
+    if (entry.sessions.empty())
+      return presence_offline;
+    return entry.typing_until != 0 ? presence_typing : presence_online;
+  }
+//不在线也没人关注的用户不留在表里
+  void sweep(user_map::iterator it)
+  {
+    if (it->second.sessions.empty() && it->second.watchers.empty())
+      users_.erase(it);
+  }
+//输入状态到期时检查：期间又有输入就按新的到期时间再等
+  void check_typing(const std::string& user)
+  {
+    auto it = users_.find(user);
+    if (it == users_.end() || it->second.typing_until == 0)
+      return;
+    std::uint64_t now = timers_.now();
+    if (it->second.typing_until > now)
+    {
+      timers_.schedule(it->second.typing_until - now, [this, user]() { check_typing(user); });
+      return;
+    }
+    it->second.typing_until = 0;
+    changed(user);
+  }
+
+  void changed(const std::string& user)
+  {
+    dirty_.insert(user);
+    if (window_.count() <= 0)
+    {
+      flush();
+    }
+    else if (dirty_.size() == 1)//窗口从第一个变化开始计时
+    {
+      timer_.expires_after(window_);
+      timer_.async_wait(
+          [this](boost::system::error_code ec)
+          {
+            if (!ec)
+              flush();
+          });
+    }
+  }
+
+  void flush()
+  {
+    std::unordered_set<std::string> dirty;
+    dirty.swap(dirty_);
+    for (const auto& user: dirty)
+    {
+      auto it = users_.find(user);
+      if (it == users_.end())
+        continue;
+      user_entry& entry = it->second;
+      presence_state state = current(entry);
+      presence_state before = entry.announced;
+      entry.announced = state;
+      if (state != before || !entry.sent.empty())//每个关注者只在它知道的状态变了时才收到
+      {
+        chat_frame_ptr notice = make_frame("/presence " + user + " " + presence_name(state));
+        entry.watchers.for_each(
+            [this, &entry, &notice, before, state](std::uint32_t id)
+            {
+              auto sent = entry.sent.find(id);
+              if ((sent == entry.sent.end() ? before : sent->second) != state)
+                table_[id]->deliver(notice);
+            });
+        entry.sent.clear();
+      }
+      sweep(it);
+    }
+  }
+
+  member_table& table_;
+  timer_wheel& timers_;
+  std::chrono::milliseconds window_;
+  boost::asio::steady_timer timer_;
+  user_map users_;
+  std::unordered_set<std::string> dirty_;//合并窗口内状态可能变了的用户
+  enum { typing_timeout_ms = 5000 };
+};
+
+//----------------------------------------------------------------------
+//聊天大厅：按名字管理本进程的所有聊天室，第一次用到时创建，所有监听端口共用
+//聊天室空了（chat_room::idle()）--room-linger秒之后回收；客户端能让多少个聊天室同时有成员由--max-rooms限制
+class chat_hall
+{
+public:
+  chat_hall(boost::asio::io_context& io_context, const server_options& options)
+    : io_context_(io_context),
+      options_(options),
+      parking_(options.resume_grace),
+      timers_(io_context, std::chrono::milliseconds(timer_tick_ms)),
+      users_(io_context, members_, timers_, options.presence_ms)
+  {
+    if (options.deflate)
+      codec_.reset(new deflate_codec(options.dictionary.empty() ? std::string()
+            : deflate_codec::load_dictionary(options.dictionary)));
+    if (!options.tls_cert.empty() && !options.tls_key.empty())
+    {
+      tls_context_.reset(new boost::asio::ssl::context(boost::asio::ssl::context::tls_server));
+      configure_tls_server(*tls_context_, options.tls_cert, options.tls_key, options.ktls);
+    }
+    hooks_.on_occupied =
+        [this](const std::string& room, bool occupied)
+        {
+          if (occupied)
+            ++occupied_;
+          else
+          {
+            --occupied_;
+            schedule_reclaim(room);
+          }
+        };
+  }
+//取聊天室，没有时创建，不受--max-rooms限制：监听端口、共享内存输入、其他节点和热升级用
+//新建的聊天室同样过--room-linger秒检查一次，只是查询过、一直没人加入的不会留下来
+  chat_room& room(const std::string& name)
+  {
+    std::shared_ptr<chat_room>& room = rooms_[name];
+    if (!room)
+    {
+      room = std::make_shared<chat_room>(io_context_, options_, name, codec_.get(), hooks_, members_);
+      schedule_reclaim(name);
+    }
+    return *room;
+  }
+//客户端要进入的聊天室：它还没有成员、而有成员的聊天室数已达--max-rooms时返回空
+//只计有成员的聊天室，客户端断开后它占的名额随即空出来，没人的聊天室等着回收，不挡新的名字
+  chat_room* open_room(const std::string& name)
+  {
+    auto it = rooms_.find(name);
+    bool occupied = it != rooms_.end() && !it->second->members().empty();
+    if (options_.max_rooms > 0 && !occupied
+        && occupied_ >= static_cast<std::size_t>(options_.max_rooms))
+      return nullptr;
+    return &room(name);
+  }
+//节点互联在这里挂上回调，对已创建和以后创建的聊天室都生效
+  room_hooks& hooks()
+  {
+    return hooks_;
+  }
+//服务器端TLS配置，所有监听socket共用一份：会话缓存和票据密钥在一起，重连到别的端口或--reuse-port的别的监听socket也能恢复
+//没有配置证书时为空
+  boost::asio::ssl::context* tls_context()
+  {
+    return tls_context_.get();
+  }
+//断线暂存的会话，所有监听端口共用，客户端重连到哪个端口都可以接回
+  session_parking& parking()
+  {
+    return parking_;
+  }
+//用户名到会话的索引，私信和在线状态用
+  user_directory& users()
+  {
+    return users_;
+  }
+//同一IP的连接（不论连到哪个端口、哪个监听socket）共享一个限速器，表中只存weak_ptr，最后一个连接断开后限速器随之释放
+  std::shared_ptr<rate_limiter> ip_limiter(const boost::asio::ip::address& address)
+  {
+    if (options_.ip_msg_rate <= 0 && options_.ip_byte_rate <= 0)
+      return nullptr;
+
+    std::weak_ptr<rate_limiter>& entry = ip_limiters_[address];
+    std::shared_ptr<rate_limiter> limiter = entry.lock();
+    if (!limiter)
+    {
+      limiter = std::make_shared<rate_limiter>(options_.ip_msg_rate, options_.ip_byte_rate);
+      entry = limiter;
+    }
+
+    if (ip_limiters_.size() >= 2 * ip_limiters_swept_)//表的大小翻倍时清理一次已失效的项
+    {
+      for (auto it = ip_limiters_.begin(); it != ip_limiters_.end();)
+      {
+        if (it->second.expired())
+          it = ip_limiters_.erase(it);
+        else
+          ++it;
+      }
+      ip_limiters_swept_ = std::max<std::size_t>(ip_limiters_.size(), 64);
+    }
+    return limiter;
+  }
+//所有普通TCP连接共用的读缓冲区：连接可读时才读进来，处理完就还回去，只在一个回调之内使用
+//事件循环是单线程的，同一时刻只有一个回调在用它
+  enum { read_buffer_size = 65536 };
+  char* read_buffer()
+  {
+    if (!read_buffer_)
+      read_buffer_.reset(new char[read_buffer_size]);
+    return read_buffer_.get();
+  }
+//有数据从外面进来时（客户端连接上读到数据或出错、新连接、其他节点的消息、共享内存里的消息）记一次
+//忙等模式据此区分真正的输入和定时器：只有输入才让事件循环重新空转
+  void note_input()
+  {
+    ++inputs_;
+  }
+
+  std::uint64_t inputs() const
+  {
+    return inputs_;
+  }
+//所有连接共用的时间轮，用于心跳、空闲超时和断线暂存这类精度要求不高、数量很多的定时
+  timer_wheel& timers()
+  {
+    return timers_;
+  }
+//所有现存的聊天室
+  std::vector<chat_room*> rooms() const
+  {
+    std::vector<chat_room*> all;
+    for (const auto& room: rooms_)
+      all.push_back(room.second.get());
+    return all;
+  }
+//按编号取成员，编号必须来自某个聊天室的成员集合
+  const chat_participant_ptr& member(std::uint32_t id) const
+  {
+    return members_[id];
+  }
+//存活的chat_session计数，由会话自己增减；会话可能比大厅活得长（进程退出时残留在事件循环里），所以共享所有权
+  const std::shared_ptr<std::size_t>& live_sessions() const
+  {
+    return live_sessions_;
+  }
+//当前有本地成员的聊天室
+  std::vector<std::string> active_rooms() const
+  {
+    std::vector<std::string> names;
+    for (const auto& room: rooms_)
+      if (room.second->active())
+        names.push_back(room.first);
+    return names;
+  }
+//聊天室名字只能由字母、数字和 - _ . 组成，节点间协议按空格和换行分隔
+  static bool valid_name(const std::string& name)
+  {
+    if (name.empty() || name.size() > 64)
+      return false;
+    for (char c: name)
+      if (!std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_' && c != '.')
+        return false;
+    return true;
+  }
+
+private:
+//空着的聊天室过--room-linger秒再看：期间有人来过（vacated()变了）或者还有事没做完的不回收
+//聊天室可能正在调用回调（成员离开时），所以至少等到下一个tick
+  void schedule_reclaim(const std::string& name)
+  {
+    auto it = rooms_.find(name);
+    if (it == rooms_.end())
+      return;
+    std::weak_ptr<chat_room> weak(it->second);
+    std::uint64_t vacated = it->second->vacated();
+    timers_.schedule(timers_.ticks(std::chrono::seconds(options_.room_linger)) + 1,
+        [this, weak, vacated]()
+        {
+          auto room = weak.lock();
+          if (!room || room->vacated() != vacated)
+            return;
+          if (!room->idle())
+          {
+            if (room->members().empty())//还有消息在分发或合并中，过一会儿再看
+              schedule_reclaim(room->name());
+            return;
+          }
+          auto it = rooms_.find(room->name());
+          if (it != rooms_.end() && it->second == room)//已回收过、又建了同名的新聊天室时不动它
+            rooms_.erase(it);
+        });
+  }
+
+  boost::asio::io_context& io_context_;
+  const server_options& options_;
+  std::unique_ptr<boost::asio::ssl::context> tls_context_;//见tls_context()，比所有会话后析构
+  member_table members_;//所有聊天室共用，比聊天室后析构
+  std::map<std::string, std::shared_ptr<chat_room>> rooms_;
+  std::size_t occupied_ = 0;//有成员的聊天室数
+  std::unique_ptr<deflate_codec> codec_;//所有聊天室共用
+  room_hooks hooks_;
+  session_parking parking_;
+  enum { timer_tick_ms = 100 };//时间轮精度
+  timer_wheel timers_;
+  user_directory users_;
+  std::shared_ptr<std::size_t> live_sessions_ = std::make_shared<std::size_t>(0);
+  std::unique_ptr<char[]> read_buffer_;
+  std::map<boost::asio::ip::address, std::weak_ptr<rate_limiter>> ip_limiters_;
+  std::size_t ip_limiters_swept_ = 64;
+  std::uint64_t inputs_ = 0;//见note_input()
+};
+
+//----------------------------------------------------------------------
+
+using busy_poll_option = boost::asio::detail::socket_option::integer<SOL_SOCKET, SO_BUSY_POLL>;
+using reuse_port_option = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+using incoming_cpu_option = boost::asio::detail::socket_option::integer<SOL_SOCKET, SO_INCOMING_CPU>;
+using notsent_lowat_option = boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_NOTSENT_LOWAT>;
+using cork_option = boost::asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_CORK>;
+
+//----------------------------------------------------------------------
+
+class chat_session
+  : public chat_participant,
+    public std::enable_shared_from_this<chat_session>
+{
+public:
+//room为连上后默认加入的聊天室
+//ip_limiter为同一IP的所有连接共享的限速器，可以为空
+//tls_context不为空时连接使用TLS
+  chat_session(chat_transport::socket_type socket, chat_hall& hall, chat_room& room,
+      const server_options& options, std::shared_ptr<rate_limiter> ip_limiter,
+      boost::asio::ssl::context* tls_context)
+    : transport_(std::move(socket)),
+      hall_(hall),
+      room_(room.shared_from_this()),
+      limiter_(options.msg_rate, options.byte_rate),
+      ip_limiter_(std::move(ip_limiter)),
+      ping_after_(hall.timers().ticks(std::chrono::seconds(options.ping_interval))),
+      idle_limit_(hall.timers().ticks(std::chrono::seconds(options.read_timeout))),
+      live_(hall.live_sessions()),
+      cork_(options.cork)
+  {
+    if (tls_context)
+      transport_.use_tls(*tls_context);
+    ++*live_;
+  }
+
+  ~chat_session()
+  {
+    --*live_;
+  }
+//TLS连接先握手，握手成功后才加入聊天室
+//空闲检查从连上就开始，握手卡住的连接同样会超时断开
+  void start()
+  {
+    start_idle_checks();
+    if (!transport_.tls())
+    {
+      join_room();
+      return;
+    }
+
+    auto self(shared_from_this());
+    transport_.async_handshake(boost::asio::ssl::stream_base::server,
+        [this, self](boost::system::error_code ec)
+        {
+          if (!ec)
+          {
+            transport_.check_ktls();
+            join_room();
+          }
+        });
+  }
+
+  void deliver(const chat_frame_ptr& frame)
+  {
+    //第一次时 write_in_progress 为 false
+    //防止多次调用do_write(),因为当消息队列非空时，do_write会自己继续调用do_write()
+    //只有当消息队列为空时，才会从此处成功调用do_write()
+    //回放历史期间写队列队首始终是正在写的历史消息，新消息排在其后
+    bool write_in_progress = !write_msgs_.empty();  
+    write_msgs_.push_back(frame);
+    if (frozen_)//正在交给新进程，只排队，交接时一起交出去
+      return;
+    if (parked_)//暂存期间只排队；积压太多就不再等客户端（聊天室正在遍历成员，离开要推迟）
+    {
+      if (write_msgs_.size() > max_parked_frames)
+      {
+        auto self(shared_from_this());
+        boost::asio::post(transport_.socket().get_executor(),
+            [this, self]()
+            {
+              if (parked_)
+                expire();
+            });
+      }
+      return;
+    }
+    if (!write_in_progress)
+    {
+      //第一次
+      do_write();
+    }
+  }
+
+  frame_encoding encoding() const
+  {
+    return encoding_;
+  }
+//聊天室历史重新编号：记下的回放区间作废，不再回放，客户端随后收到新的编号通知
+  void history_restarted()
+  {
+    replay_next_ = replay_end_ = 0;
+  }
+//断线重连的客户端带着令牌回来：换上新连接，写队列里还没发出去的接着发
+//断开时正在写的那几个frame不知道客户端收到没有，重发一遍，前面补一条编号通知让客户端按编号去重
+//input为新连接上紧跟在 /attach 后面、已经读进来的数据
+  void adopt(chat_transport transport, const char* input, std::size_t length)
+  {
+    ++generation_;//旧连接上残留的回调都作废
+    parked_ = false;
+    reading_ = writing_ = false;
+    last_read_ = hall_.timers().now();
+    transport_ = std::move(transport);
+    corked_ = cork_;//新连接上原来的会话可能正写到一半，放开一次
+    set_cork(false);
+
+    std::size_t in_flight = std::min(write_buffers_.size(), write_msgs_.size());
+    for (std::size_t i = 0; i < in_flight; ++i)
+    {
+      const chat_frame& frame = *write_msgs_[i];
+      std::uint64_t seq = frame.parts().empty() ? frame.seq() : frame.parts().front()->seq();
+      if (seq != 0)
+      {
+        write_msgs_.push_front(seq_notice(room_->name(), seq));
+        replay_after_ = std::max(replay_after_, in_flight) + 1;
+        break;
+      }
+    }
+    write_buffers_.clear();
+
+    if (!write_msgs_.empty() || replay_next_ < replay_end_)
+      do_write();
+    pending_input_.clear();//旧连接上没读完的半条消息作废
+    if (consume(input, length))
+      resume_reading();
+  }
+//热升级：不再发起新的读写，等正在进行的写完成、读被取消后调用ready，之后由export_state()交出连接
+//写到一半取消会让客户端收到半条消息，所以只取消读；缓冲区里读了一半的消息一起交出去
+//TLS连接的加密状态在OpenSSL里交不出去，暂存中和还没加入聊天室的会话也不交，这些返回false
+  bool freeze(std::function<void()> ready)
+  {
+    if (transport_.tls() || parked_ || !joined_ || frozen_)
+      return false;
+    frozen_ = true;
+    on_frozen_ = std::move(ready);
+    if (!writing_)
+    {
+      boost::system::error_code ignored;
+      transport_.socket().cancel(ignored);
+    }
+    check_frozen();
+    return true;
+  }
+//冻结完成且连接仍然可用（没有在冻结期间断开）
+  bool transferable()
+  {
+    return frozen_ && !reading_ && !writing_ && !parked_ && transport_.socket().is_open();
+  }
+
+  int native_handle()
+  {
+    return transport_.socket().native_handle();
+  }
+//会话状态，格式为 SESSION <聊天室> <编码> <回放起点> <回放终点> <令牌|-> <半条消息长度> <回放前数据长度>
+//  [<过滤后期望的编号> <过滤条件>...]
+//有用户名或关注的用户时另起一行：USER <用户名|-> <关注的用户>...
+//payload依次为读了一半的消息、回放前要写的frame、其余待写的frame，后两者已按本连接的编码编好
+  std::string export_state(std::string& payload)
+  {
+    std::string head, tail;
+    for (std::size_t i = 0; i < write_msgs_.size(); ++i)
+      (i < replay_after_ ? head : tail) += room_->encoded(*write_msgs_[i], encoding_);
+    payload = pending_input_;
+    payload += head;
+    payload += tail;
+
+    std::ostringstream out;
+    out << "SESSION " << room_->name() << ' ' << encoding_ << ' ' << replay_next_
+      << ' ' << replay_end_ << ' ' << (token_.empty() ? "-" : token_)
+      << ' ' << pending_input_.size() << ' ' << head.size();
+    if (!filters_.empty())
+    {
+      out << ' ' << room_->filter_next(shared_from_this());
+      for (const auto& filter: filters_)
+        out << ' ' << filter;
+    }
+    if (!nick_.empty() || !watching_.empty())
+    {
+      out << "\nUSER " << (nick_.empty() ? "-" : nick_);
+      for (const auto& user: watching_)
+        out << ' ' << user;
+    }
+    return out.str();
+  }
+//连接已交给新进程：关闭自己这份描述符（连接本身不受影响），悄悄离开聊天室和用户目录
+  void release()
+  {
+    transport_.close();
+    depart(false);
+  }
+//新进程接过连接：按export_state()的记录恢复会话，接着写没写完的，接着读读了一半的
+  void restore(std::istream& record, const std::string& payload)
+  {
+    std::string line;
+    std::getline(record, line);
+    std::istringstream in(line);
+    std::string name, token;
+    int encoding = plain_encoding;
+    std::size_t partial = 0, head = 0;
+    in >> name >> encoding >> replay_next_ >> replay_end_ >> token >> partial >> head;
+    if (!in || !chat_hall::valid_name(name) || encoding < 0 || encoding >= encoding_count
+        || partial + head > payload.size())
+      throw std::runtime_error("invalid session record");
+
+    joined_ = true;
+    if (hall_.parking().enabled() && token != "-")
+      token_ = token;
+    room_ = hall_.room(name).shared_from_this();
+    encoding_ = room_->codec() ? static_cast<frame_encoding>(encoding) : plain_encoding;
+    room_->join(shared_from_this());
+    std::uint64_t filter_next = 0;
+    std::string filter;
+    if (in >> filter_next)
+      while (in >> filter && filters_.size() < max_filters)
+        if (topic_index::valid(filter))
+          filters_.insert(filter);
+    room_->filter(shared_from_this(), filters_, filter_next);
+    std::string kind, nick, user;
+    if (record >> kind >> nick && kind == "USER")
+    {
+      if (chat_hall::valid_name(nick))
+      {
+        nick_ = nick;
+        hall_.users().add(nick_, shared_from_this(), false);
+      }
+      while (record >> user && watching_.size() < max_watches)
+        if (chat_hall::valid_name(user) && watching_.insert(user).second)
+          hall_.users().watch(user, member_id());
+    }
+    replay_end_ = std::min(replay_end_, room_->history_end());
+    if (head > 0)
+      write_msgs_.push_back(opaque_frame(payload.substr(partial, head)));
+    replay_after_ = write_msgs_.size();
+    if (partial + head < payload.size())
+      write_msgs_.push_back(opaque_frame(payload.substr(partial + head)));
+
+    start_idle_checks();
+    if (!write_msgs_.empty() || replay_next_ < replay_end_)
+      do_write();
+    if (consume(payload.data(), partial))
+      resume_reading();
+  }
+
+private:
+//已经编好的一段数据，原样写给本连接；各种编码都是它，连接中途换编码也不会重新编码
+  static chat_frame_ptr opaque_frame(const std::string& data)
+  {
+    chat_frame_ptr frame = std::make_shared<chat_frame>(std::vector<chat_frame_ptr>());
+    for (int i = 0; i < encoding_count; ++i)
+      frame->set(static_cast<frame_encoding>(i), data);
+    return frame;
+  }
+
+  void check_frozen()
+  {
+    if (frozen_ && on_frozen_ && !reading_ && !writing_)
+    {
+      std::function<void()> ready = std::move(on_frozen_);
+      on_frozen_ = nullptr;
+      ready();
+    }
+  }
+//冻结后读操作结束时调用，返回true表示不再继续读，缓冲区里剩下的半条消息随会话交出去
+  bool stop_reading()
+  {
+    if (!frozen_)
+      return false;
+    check_frozen();
+    return true;
+  }
+
+  void start_idle_checks()
+  {
+    if (ping_after_ || idle_limit_)
+    {
+      schedule_idle_check(std::min(ping_after_ ? ping_after_ : idle_limit_,
+            idle_limit_ ? idle_limit_ : ping_after_));
+      last_read_ = hall_.timers().now();
+    }
+  }
+
+//开启断线恢复时，先给客户端一小段时间发 /attach 接回断线前的会话，期间不加入聊天室，免得白白回放历史
+//客户端的第一条消息不是 /attach，或者等待超时，就按新会话加入聊天室
+  void join_room()
+  {
+    if (hall_.parking().enabled())
+    {
+      waiting_attach_ = true;
+      std::weak_ptr<chat_session> weak(shared_from_this());
+      timer_wheel& timers = hall_.timers();
+      timers.schedule(timers.ticks(std::chrono::milliseconds(attach_window_ms)) + 1,
+          [weak]()
+          {
+            auto self = weak.lock();
+            if (self && self->waiting_attach_)
+            {
+              self->waiting_attach_ = false;
+              self->welcome();
+            }
+          });
+    }
+    else
+    {
+      welcome();
+    }
+    do_read();
+  }
+//作为新会话加入默认聊天室；开启断线恢复时先把恢复令牌发给客户端：/token <令牌>
+  void welcome()
+  {
+    joined_ = true;
+    if (hall_.parking().enabled())
+    {
+      token_ = session_parking::issue();
+      reply("/token " + token_);
+    }
+    enter_room(*room_);
+  }
+//等待 /attach 期间收到了第一条消息，返回true表示连接已交给断线前的会话，rest为缓冲区里紧跟其后的数据
+//令牌无效时回复 /attach failed，客户端再用 /resume 按编号恢复；不是 /attach 时按新会话加入后照常处理这条消息
+  bool attach(const chat_message& msg, const char* rest, std::size_t length)
+  {
+    waiting_attach_ = false;
+    std::string body(msg.body(), msg.body_length());
+    std::istringstream in(body);
+    std::string command, token;
+    in >> command >> token;
+    if (command != "/attach")
+    {
+      welcome();
+      if (!handle_command(msg))
+        room_->deliver(msg);
+      return false;
+    }
+
+    if (std::shared_ptr<chat_session> parked = hall_.parking().claim(token))
+    {
+      parked->adopt(std::move(transport_), rest, length);
+      return true;
+    }
+    reply("/attach failed");
+    welcome();
+    return false;
+  }
+//连接断开：开启断线恢复时暂存会话，宽限期内客户端带令牌重连就接回来，期间仍留在聊天室里，新消息照常排队
+  void disconnect()
+  {
+    if (parked_)
+      return;
+    if (frozen_)//交接途中断开的不交出去，也不再暂存，随旧进程退出
+    {
+      transport_.close();
+      check_frozen();
+      return;
+    }
+    waiting_attach_ = false;//还没加入聊天室时就此作罢
+    if (token_.empty())
+    {
+      depart();
+      return;
+    }
+
+    parked_ = true;
+    transport_.close();
+    hall_.parking().park(token_, shared_from_this());
+    std::weak_ptr<chat_session> weak(shared_from_this());
+    unsigned generation = generation_;//期间被接回又断开的，以最后一次断开为准
+    timer_wheel& timers = hall_.timers();
+    timers.schedule(timers.ticks(hall_.parking().grace()) + 1,
+        [weak, generation]()
+        {
+          auto self = weak.lock();
+          if (self && self->parked_ && self->generation_ == generation)
+            self->expire();
+        });
+  }
+//宽限期已过或暂存期间积压太多：彻底离开
+  void expire()
+  {
+    parked_ = false;
+    hall_.parking().remove(token_);
+    token_.clear();//之后还有写失败时直接离开，不会再暂存一次
+    depart();
+  }
+//彻底离开：取消关注，下线，退出聊天室（最后一步，之后成员编号收回）
+//announce为false时不通知关注者（连接交给了新进程，用户并没有下线）
+  void depart(bool announce = true)
+  {
+    auto self(shared_from_this());
+    for (const auto& user: watching_)
+      hall_.users().unwatch(user, member_id());
+    watching_.clear();
+    if (!nick_.empty())
+      hall_.users().remove(nick_, this, announce);
+    room_->leave(self);
+  }
+//空闲检查：超过read_timeout没收到任何数据就关闭连接（之后按断线处理），超过ping_interval先发 /ping 探一下
+//收到数据时只记下当前tick，不动定时器；检查时按最后收到数据的时间算出下一次检查的时间
+//会话析构后weak_ptr失效，检查自然停止
+  void schedule_idle_check(std::uint64_t ticks)
+  {
+    std::weak_ptr<chat_session> weak(shared_from_this());
+    hall_.timers().schedule(ticks,
+        [weak]()
+        {
+          if (auto self = weak.lock())
+            self->check_idle();
+        });
+  }
+
+  void check_idle()
+  {
+    std::uint64_t now = hall_.timers().now();
+    std::uint64_t last = std::max(last_read_, last_ping_);
+    if (!parked_)
+    {
+      if (idle_limit_ && now - last_read_ >= idle_limit_ && !throttled())
+      {
+        transport_.close();
+      }
+      else if (ping_after_ && joined_ && now - last >= ping_after_)
+      {
+        last_ping_ = last = now;
+        reply("/ping");
+      }
+    }
+
+    std::uint64_t next = idle_limit_ ? last_read_ + idle_limit_ : last + ping_after_;
+    if (ping_after_)
+      next = std::min(next, last + ping_after_);
+    schedule_idle_check(next > now ? next - now : std::max(ping_after_, idle_limit_));
+  }
+//加入时记下需要回放的历史区间，随着socket写完一条再回放下一条
+//from为客户端想要的第一条消息编号（恢复时为最后收到的编号加一），为0、已被淘汰或超出现有编号（服务器重启过）时从最早的历史开始
+//先发编号通知，加入之前已排队的消息和编号通知都写完后才开始回放
+  void enter_room(chat_room& room, std::uint64_t from = 0)
+  {
+    room_ = room.shared_from_this();
+    room_->join(shared_from_this());
+    replay_end_ = room_->history_end();
+    room_->filter(shared_from_this(), filters_, replay_end_);
+    replay_next_ = from >= room_->history_begin() && from <= replay_end_
+      ? from : room_->history_begin();
+    replay_after_ = write_msgs_.size() + 1;
+    deliver(seq_notice(room_->name(), replay_next_));
+  }
+//读：普通TCP连接先只等可读，不占用缓冲区；可读后用非阻塞recv读进所有连接共用的缓冲区，
+//读到的数据里可能有好几条完整的消息，逐条处理，剩下的半条才复制到本连接的pending_input_里
+//空闲连接因此不持有任何读缓冲区；客户端连发很多条短消息时一次系统调用就能拿到一批
+//TLS连接可能有已解密但还没取走的数据，等socket可读会漏掉，所以用自己的缓冲区async_read_some
+//捕获列表self防止自己失效
+  void do_read()
+  {
+    if (frozen_)
+      return;
+    auto self(shared_from_this());
+    unsigned generation = generation_;
+    reading_ = true;
+    if (transport_.tls())
+    {
+      if (!tls_read_buf_)
+        tls_read_buf_.reset(new char[tls_read_size]);
+      transport_.async_read_some(boost::asio::buffer(tls_read_buf_.get(), tls_read_size),
+          [this, self, generation](boost::system::error_code ec, std::size_t length)
+          {
+            if (generation == generation_)//连接已被替换时什么都不做
+              on_read(ec, tls_read_buf_.get(), length);
+          });
+      return;
+    }
+
+    transport_.socket().async_wait(stream_protocol::socket::wait_read,
+        [this, self, generation](boost::system::error_code ec)
+        {
+          if (generation != generation_)
+            return;
+          std::size_t length = 0;
+          char* buffer = hall_.read_buffer();
+          if (!ec)
+          {
+            ssize_t n = ::recv(transport_.socket().native_handle(), buffer,
+                chat_hall::read_buffer_size, MSG_DONTWAIT);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            {
+              reading_ = false;
+              do_read();//虚假唤醒，接着等
+              return;
+            }
+            if (n > 0)
+              length = static_cast<std::size_t>(n);
+            else
+              ec = n == 0 ? boost::asio::error::eof
+                : boost::system::error_code(errno, boost::system::system_category());
+          }
+          on_read(ec, buffer, length);
+        });
+  }
+
+  void on_read(boost::system::error_code ec, const char* data, std::size_t length)
+  {
+    reading_ = false;
+    last_read_ = hall_.timers().now();
+    hall_.note_input();
+    if (ec == boost::asio::error::operation_aborted && stop_reading())
+      return;
+    if (ec)
+    {
+      disconnect();  //调用leave会将智能指针从set中erase,引用计数变为0，自动析构
+      return;
+    }
+    bool alive;
+    if (pending_input_.empty())
+    {
+      alive = consume(data, length);
+    }
+    else
+    {
+      pending_input_.append(data, length);
+      alive = consume_pending();
+    }
+    if (alive && !stop_reading())
+      resume_reading();//超出限速时先暂停
+  }
+
+  bool consume_pending()
+  {
+    std::string input;
+    input.swap(pending_input_);
+    return consume(input.data(), input.size());
+  }
+//处理data中完整的消息，剩下的（半条消息，或限速暂停时还没处理的）存到pending_input_
+//返回false表示连接已断开，或已交给断线前的会话
+  bool consume(const char* data, std::size_t length)
+  {
+    std::size_t pos = 0;
+    while (pause_ <= token_bucket::clock::duration::zero()
+        && length - pos >= chat_message::header_length)
+    {
+      chat_message msg;
+      std::memcpy(msg.data(), data + pos, chat_message::header_length);
+      if (!msg.decode_header())//头部信息不合法，断开
+      {
+        disconnect();
+        return false;
+      }
+      if (length - pos < msg.length())
+        break;
+      std::memcpy(msg.body(), data + pos + chat_message::header_length, msg.body_length());
+      pos += msg.length();
+      account(msg.length());
+
+      if (msg.compressed() && !decompress(msg))
+      {
+        disconnect();//压缩数据无法解开，按出错处理
+        return false;
+      }
+      if (waiting_attach_)
+      {
+        if (attach(msg, data + pos, length - pos))
+          return false;//连接已交给断线前的会话
+      }
+      else if (!handle_command(msg))
+      {
+        room_->deliver(msg);//分发消息
+        if (typing_)
+          set_typing(false);//消息发出去了，不再是正在输入
+      }
+    }
+    std::string(data + pos, length - pos).swap(pending_input_);//不到16字节时不分配内存，原来的大块随之释放
+    return true;
+  }
+//客户端发来的压缩消息先解压，聊天室中只保存和分发原消息
+  bool decompress(chat_message& msg)
+  {
+    chat_message plain;
+    if (!room_->codec() || !room_->codec()->decompress(msg, plain))
+      return false;
+    msg = plain;
+    return true;
+  }
+//处理以'/'开头的控制消息，返回true表示已处理，不转发给聊天室
+//  /compress deflate <字典id>   协商压缩，字典id必须与服务器一致，回复同样的内容表示接受，回复 /compress off 表示拒绝
+//  /join <聊天室>               离开当前聊天室，加入（必要时创建）另一个，回复 /join <聊天室>
+//                               它还没有成员、而有成员的聊天室数已达--max-rooms时回复 /join too many rooms；/resume 同样
+//  /resume <聊天室> <编号>       断线重连后加入聊天室，只回放编号之后的消息，回复 /resume <聊天室>
+//  /attach <令牌>               接回断线前的会话，只能作为连接上的第一条消息，否则回复 /attach failed
+//  /ping                        回复 /pong；/pong 是对服务器 /ping 的回复，收到即说明连接还活着
+//  /sub <条件>...               只接收匹配任一条件的消息（写法见topic_index），回复 /sub 和当前全部条件
+//  /unsub [<条件>...]           去掉这些条件，不带参数时去掉全部、恢复接收所有消息，回复同 /sub
+//  /nick <用户名>               以这个用户名上线，可以有几个会话用同一个用户名，回复 /nick <用户名>
+//  /msg <用户名> <文本>         私信，对方的每个会话收到 /msg <发送者> <文本>；对方不在线时回复 /presence <用户名> offline
+//  /watch <用户名>...           关注这些用户的在线状态，回复 /watch 和全部关注的用户，再对每个新关注的用户回复一次当前状态
+//  /unwatch [<用户名>...]       取消关注，不带参数时取消全部，回复同 /watch
+//  /typing [off]                正在输入（几秒后或发出消息后自动结束），关注者收到 /presence <用户名> typing
+  bool handle_command(const chat_message& msg)
+  {
+    std::string body(msg.body(), msg.body_length());
+    std::istringstream in(body);
+    std::string command;
+    in >> command;
+    if (command == "/compress")
+      negotiate_compression(in);
+    else if (command == "/join")
+      switch_room(in);
+    else if (command == "/resume")
+      resume_room(in);
+    else if (command == "/attach")
+      reply("/attach failed");
+    else if (command == "/ping")
+      reply("/pong");
+    else if (command == "/sub" || command == "/unsub")
+      change_filters(command == "/sub", in);
+    else if (command == "/nick")
+      change_nick(in);
+    else if (command == "/msg")
+      direct_message(in);
+    else if (command == "/watch" || command == "/unwatch")
+      change_watches(command == "/watch", in);
+    else if (command == "/typing")
+      set_typing(body != "/typing off");
+    else if (command == "/pong")
+      ;
+    else if (command == "/seq" || command == "/presence" || command == "/token")
+      ;//编号通知、在线状态和恢复令牌只由服务器发出，客户端发来的丢弃，以免其他客户端误以为是通知
+    else
+      return false;
+    return true;
+  }
+
+//先进入新聊天室再离开原来的，成员编号不变，关注别人的在线状态照常收到
+  void switch_room(std::istream& in)
+  {
+    std::string name;
+    in >> name;
+    if (!chat_hall::valid_name(name))
+    {
+      reply("/join invalid room name");
+      return;
+    }
+    if (name != room_->name())
+    {
+      chat_room* room = hall_.open_room(name);
+      if (!room)
+      {
+        reply("/join too many rooms");
+        return;
+      }
+      std::shared_ptr<chat_room> previous = room_;
+      enter_room(*room);
+      previous->leave(shared_from_this());
+    }
+    reply("/join " + name);
+  }
+//同一个聊天室也重新进入，按客户端给的编号重新确定回放区间
+  void resume_room(std::istream& in)
+  {
+    std::string name;
+    std::uint64_t last_seq = 0;
+    in >> name >> last_seq;
+    if (!chat_hall::valid_name(name))
+    {
+      reply("/resume invalid room name");
+      return;
+    }
+    chat_room* room = hall_.open_room(name);
+    if (!room)
+    {
+      reply("/resume too many rooms");
+      return;
+    }
+    std::shared_ptr<chat_room> previous = room_;
+    enter_room(*room, last_seq + 1);
+    if (previous != room_)
+      previous->leave(shared_from_this());
+    reply("/resume " + name);
+  }
+
+//过滤条件跟着会话走，换聊天室后照样有效
+  void change_filters(bool subscribe, std::istream& in)
+  {
+    std::string filter;
+    bool any = false;
+    while (in >> filter)
+    {
+      any = true;
+      if (!subscribe)
+        filters_.erase(filter);
+      else if (topic_index::valid(filter) && filters_.size() < max_filters)
+        filters_.insert(filter);
+    }
+    if (!subscribe && !any)
+      filters_.clear();
+    room_->filter(shared_from_this(), filters_);
+
+    std::string text = "/sub";
+    for (const auto& f: filters_)
+      text += " " + f;
+    reply(text);
+  }
+
+  void change_nick(std::istream& in)
+  {
+    std::string name;
+    in >> name;
+    if (!chat_hall::valid_name(name))
+    {
+      reply("/nick invalid name");
+      return;
+    }
+    if (name != nick_)
+    {
+      if (!nick_.empty())
+      {
+        set_typing(false);
+        hall_.users().remove(nick_, this);
+      }
+      nick_ = name;
+      hall_.users().add(nick_, shared_from_this());
+    }
+    reply("/nick " + nick_);
+  }
+//按用户名查表直接交给对方的会话，对方暂存中的会话照常排队，接回后收到
+  void direct_message(std::istream& in)
+  {
+    std::string user, text;
+    in >> user;
+    std::getline(in >> std::ws, text);
+    if (nick_.empty())
+    {
+      reply("/msg failed: choose a name with /nick first");
+      return;
+    }
+    if (!chat_hall::valid_name(user))
+    {
+      reply("/msg failed: invalid user name");
+      return;
+    }
+    if (text.empty())
+    {
+      reply("/msg failed: empty message");
+      return;
+    }
+    std::string body = "/msg " + nick_ + " " + text;
+    if (body.size() > chat_message::max_body_length)//换上发送者的名字后可能变长，不截断
+    {
+      reply("/msg failed: too long");
+      return;
+    }
+    const std::vector<chat_participant_ptr>* sessions = hall_.users().sessions(user);
+    if (!sessions)
+    {
+      reply("/presence " + user + " offline");
+      return;
+    }
+    chat_frame_ptr frame = make_frame(body);
+    for (const auto& session: *sessions)
+      session->deliver(frame);
+  }
+
+  void change_watches(bool watch, std::istream& in)
+  {
+    std::string user;
+    bool any = false;
+    std::vector<std::pair<std::string, presence_state>> added;
+    while (in >> user)
+    {
+      any = true;
+      if (!watch)
+      {
+        if (watching_.erase(user))
+          hall_.users().unwatch(user, member_id());
+      }
+      else if (chat_hall::valid_name(user) && watching_.size() < max_watches
+          && watching_.insert(user).second)
+      {
+        added.emplace_back(user, hall_.users().watch(user, member_id()));
+      }
+    }
+    if (!watch && !any)
+    {
+      for (const auto& u: watching_)
+        hall_.users().unwatch(u, member_id());
+      watching_.clear();
+    }
+
+    std::string text = "/watch";
+    for (const auto& u: watching_)
+      text += " " + u;
+    reply(text);
+    for (const auto& entry: added)
+      reply("/presence " + entry.first + " " + presence_name(entry.second));
+  }
+
+  void set_typing(bool active)
+  {
+    typing_ = active;
+    if (!nick_.empty())
+      hall_.users().typing(nick_, active);
+  }
+
+  void negotiate_compression(std::istream& in)
+  {
+    std::string method;
+    unsigned long dictionary_id = 0;
+    in >> method >> dictionary_id;
+    deflate_codec* codec = room_->codec();
+    bool accepted = codec && method == "deflate" && dictionary_id == codec->dictionary_id();
+    frame_encoding old_encoding = encoding_;
+    encoding_ = accepted ? deflate_encoding : plain_encoding;
+    room_->change_encoding(shared_from_this(), old_encoding);
+    reply(accepted ? "/compress deflate " + std::to_string(dictionary_id)
+        : std::string("/compress off"));
+  }
+//只回复给自己的消息
+  void reply(const std::string& text)
+  {
+    deliver(make_frame(text));
+  }
+//按令牌桶记账，超额时记下要暂停多久
+  void account(std::size_t length)
+  {
+    auto now = token_bucket::clock::now();
+    pause_ = limiter_.consume(length, now);
+    if (ip_limiter_)
+      pause_ = std::max(pause_, ip_limiter_->consume(length, now));
+  }
+//正在限速暂停：不读也不处理消息，读超时不计这段时间
+  bool throttled() const
+  {
+    return pause_ > token_bucket::clock::duration::zero();
+  }
+//超额时先不处理缓冲区里剩下的消息，也不再发起读操作，等令牌补足后再继续
+//暂停期间数据留在内核接收缓冲区，TCP窗口会把压力反推给发送方，而不是读出来再丢掉
+  void resume_reading()
+  {
+    if (pause_ <= token_bucket::clock::duration::zero())
+    {
+      do_read();
+      return;
+    }
+
+    if (!throttle_timer_)//只有被限速过的连接才分配定时器
+      throttle_timer_.reset(new boost::asio::steady_timer(transport_.socket().get_executor()));
+    throttle_timer_->expires_after(pause_);
+    auto self(shared_from_this());
+    unsigned generation = generation_;
+    throttle_timer_->async_wait(
+        [this, self, generation](boost::system::error_code ec)
+        {
+          if (ec || generation != generation_)
+            return;
+          pause_ = token_bucket::clock::duration::zero();
+          last_read_ = hall_.timers().now();//暂停期间是服务器自己没读，不算客户端空闲
+          if (consume_pending() && !stop_reading())
+            resume_reading();
+        });
+  }
+//异步写
+//把队列中已有的frame一次性gather写出（writev），写完后再写下一批
+//历史未回放完时，先从room中取下一条历史消息放到队首，且这一次只写它，保证历史在新消息之前
+  void do_write()
+  {
+    if (frozen_)
+      return;
+    std::size_t count = max_gather;
+    replay_end_ = std::min(replay_end_, room_->history_end());//历史重新开始过时不越过现有编号，同restore()
+    if (replay_after_ > 0)
+    {
+      count = std::min<std::size_t>(count, replay_after_);//加入聊天室之前排队的消息和编号通知先写
+    }
+    else if (replay_next_ < replay_end_)
+    {
+      count = 0;
+      bool skipped = replay_next_ < room_->history_begin();
+      if (skipped)//已被淘汰的历史跳过，并告诉客户端从哪条接着计数
+        replay_next_ = std::min(room_->history_begin(), replay_end_);
+      std::uint64_t seq = replay_next_;
+      if (replay_next_ < replay_end_)
+      {
+        write_msgs_.push_front(room_->history(replay_next_++));
+        ++count;
+      }
+      if (skipped)
+      {
+        write_msgs_.push_front(seq_notice(room_->name(), seq));
+        ++count;
+      }
+    }
+    if (write_msgs_.empty())
+      return;
+
+    write_buffers_.clear();
+    for (std::size_t i = 0; i < write_msgs_.size() && i < count; ++i)
+      write_buffers_.push_back(boost::asio::buffer(room_->encoded(*write_msgs_[i], encoding_)));
+    if (cork_ && (write_msgs_.size() > write_buffers_.size() || replay_next_ < replay_end_))
+      set_cork(true);//后面还有，这一批末尾不满一个报文段的部分先留在内核里和下一批一起发
+
+    auto self(shared_from_this());//防止被析构
+    unsigned generation = generation_;
+    writing_ = true;
+    transport_.async_write(write_buffers_,
+        [this, self, generation](boost::system::error_code ec, std::size_t /*length*/)
+        {
+          if (generation != generation_)
+            return;
+          writing_ = false;
+          if (!ec)  //如果没有发生错误
+          {
+            //去除已写完的frame
+            write_msgs_.erase(write_msgs_.begin(),
+                write_msgs_.begin() + write_buffers_.size());
+            replay_after_ -= std::min(replay_after_, write_buffers_.size());
+            write_buffers_.clear();
+            if (frozen_)//写完这一批就停下，读操作此时才能取消
+            {
+              set_cork(false);
+              boost::system::error_code ignored;
+              transport_.socket().cancel(ignored);
+              check_frozen();
+            }
+            else if (!write_msgs_.empty() || replay_next_ < replay_end_) //如果非空或历史未回放完
+            {
+              do_write(); //继续写
+            }
+            else
+            {
+              set_cork(false);//写空了，剩下的立即发出
+            }
+          }
+          else  //发生错误（一般网络问题，客户端出错）
+          {
+            disconnect();  //不暂存时析构释放资源
+          }
+        });
+  }
+
+//放开TCP_CORK时内核立即发出攒着的不满一个报文段的数据
+  void set_cork(bool on)
+  {
+    if (corked_ == on)
+      return;
+    corked_ = on;
+    boost::system::error_code ignored;
+    transport_.socket().set_option(cork_option(on), ignored);
+  }
+
+  chat_transport transport_;
+  chat_hall& hall_;//通过引用说明chat_hall和其中的聊天室生命周期更长
+  std::shared_ptr<chat_room> room_;//当前所在的聊天室，离开后仍持有，写回调里还会用到
+  std::string pending_input_;//读到但还没处理的数据，一般是半条消息，空闲连接上为空
+  enum { tls_read_size = chat_message::header_length + chat_message::max_body_length };
+  std::unique_ptr<char[]> tls_read_buf_;//只有TLS连接才分配
+  chat_frame_queue write_msgs_; 
+  enum { max_gather = 64 };//一次写操作最多合并多少个frame
+  std::vector<boost::asio::const_buffer> write_buffers_;//正在写的frame
+  std::uint64_t replay_next_ = 0;//下一条要回放的历史消息编号
+  std::uint64_t replay_end_ = 0;//加入时的history_end()，之后的消息走正常分发
+  std::size_t replay_after_ = 0;//写队列前面还有多少个frame要先于回放写出
+  rate_limiter limiter_;
+  std::shared_ptr<rate_limiter> ip_limiter_;
+  token_bucket::clock::duration pause_ = token_bucket::clock::duration::zero();//限速暂停的时长，暂停期间不处理消息
+  std::unique_ptr<boost::asio::steady_timer> throttle_timer_;
+  std::string token_;//恢复令牌，没有开启断线恢复时为空
+  bool waiting_attach_ = false;//刚连上，等客户端的第一条消息看是不是 /attach
+  bool parked_ = false;//连接已断开，会话暂存中
+  unsigned generation_ = 0;//每换一次连接加一
+  bool joined_ = false;//已作为新会话加入了聊天室
+  std::uint64_t ping_after_;//空闲多少个tick发 /ping，0为不发
+  std::uint64_t idle_limit_;//空闲多少个tick断开，0为不断开
+  std::uint64_t last_read_ = 0;//最后一次收到数据的tick
+  std::uint64_t last_ping_ = 0;//最后一次发 /ping 的tick
+  bool reading_ = false;//有读操作在进行
+  bool writing_ = false;//有写操作在进行
+  bool frozen_ = false;//正在把连接交给新进程，不再发起读写
+  std::function<void()> on_frozen_;//读写都停下后调用
+  std::shared_ptr<std::size_t> live_;//chat_hall::live_sessions()
+  std::set<std::string> filters_;//订阅的过滤条件，为空时接收所有消息
+  enum { max_filters = 64 };
+  std::string nick_;//用户名，没有设置时为空
+  std::set<std::string> watching_;//关注在线状态的用户
+  enum { max_watches = 256 };
+  bool typing_ = false;//发过 /typing，还没有发出消息
+  bool cork_;//写的时候是否使用TCP_CORK
+  bool corked_ = false;//socket当前设置了TCP_CORK
+  enum { attach_window_ms = 100 };//新连接等待 /attach 的时间
+  enum { max_parked_frames = 4096 };//暂存期间写队列最多积压多少个frame
+  frame_encoding encoding_ = plain_encoding;//本连接协商的编码
+  //deque优点，在头部删除元素和尾部插入数据不会引起迭代器失效和内存分配
+  //vector缺点，在头部删除元素非常耗时，且不提供pop_front()接口，且
+  //在不断push_back()时可能导致内存重新分配，因为vector要保证内存连续性
+  //list在此处也可行，但deque更省内存，且遍历时list更慢些
+};
+
+//----------------------------------------------------------------------
+//节点间互联：多个服务器进程组成全互联的网格，同一个聊天室的成员可以分布在不同节点上
+//每个聊天室按一致性哈希归属一个节点，由归属节点给消息排序、保存历史
+//每个节点主动连接所有--peer，在自己发起的连接上：
+//  向归属节点订阅本地有成员的聊天室，归属节点把排好序的消息批量转发过来，只分发给本地成员
+//  本地客户端发往其他节点所属聊天室的消息，先发给归属节点，等它转发回来再分发，所以各节点上的顺序一致
+//转发来的消息不会再转发出去，所以不会绕圈；这要求每个节点都把其余所有节点配置为peer，且写法与--node一致
+//连接上的协议：
+//  SUB <聊天室> [<编号>]\n             订阅（发起连接的一方发送），带编号时先补发历史中从该编号开始的消息
+//  UNSUB <聊天室>\n                    退订
+//  PUB <聊天室> <长度>\n<消息>          交给归属节点排序（发起连接的一方发送）
+//  MSG <聊天室> <长度> <编号>\n<消息>   转发（接受连接的一方发送），编号为第一条消息在归属节点的编号，其余依次加一
+//  ACK\n                              归属节点已把一条PUB交给聊天室（接受连接的一方发送，按PUB的顺序）
+//  PING\n / PONG\n                    心跳（发起连接的一方发PING，对方回PONG），一段时间什么都没收到就断开
+//发起连接的一方断开时，还没有收到ACK的PUB改为本地分发，不会丢失（ACK在路上丢了时可能重复）
+//<消息>为若干条首尾相接的完整消息，最多max_peer_frames条；对端给的长度超过上限，或一行太长时断开连接
+
+enum { max_peer_frames = 64 };//一条PUB/MSG最多带多少条消息
+enum
+{
+  max_peer_payload = max_peer_frames * (chat_message::header_length + chat_message::max_body_length),
+  max_peer_line = 256,//命令行的最大长度（聊天室名字最长64）
+  max_peer_buffer = max_peer_payload + max_peer_line,//节点连接读缓冲区的上限
+  peer_ping_ms = 5000,//心跳间隔
+  peer_timeout_ms = 15000//这么久什么都没收到就断开
+};
+
+//把若干条首尾相接的消息拆开，格式不对时返回false
+inline bool split_frames(const std::string& data, std::vector<chat_message>& msgs)
+{
+  std::size_t pos = 0;
+  while (pos < data.size())
+  {
+    chat_message msg;
+    if (data.size() - pos < chat_message::header_length)
+      return false;
+    std::memcpy(msg.data(), data.data() + pos, chat_message::header_length);
+    if (!msg.decode_header() || msg.compressed()
+        || data.size() - pos < msg.length())
+      return false;
+    std::memcpy(msg.body(), data.data() + pos + chat_message::header_length, msg.body_length());
+    pos += msg.length();
+    msgs.push_back(msg);
+  }
+  return true;
+}
+
+//把若干条首尾相接的消息逐条交给聊天室，格式不对时返回false
+//seq不为0时是第一条消息的编号，其余依次加一
+inline bool deliver_frames(chat_room& room, const std::string& data, bool remote,
+    std::uint64_t seq = 0)
+{
+  std::vector<chat_message> msgs;
+  if (!split_frames(data, msgs))
+    return false;
+  for (const auto& msg: msgs)
+  {
+    room.deliver(msg, remote, seq);
+    if (seq != 0)
+      ++seq;
+  }
+  return true;
+}
+
+class peer_session;
+
+//订阅了某个聊天室的对端节点，作为一个成员加入该聊天室，收到的本地消息转交给节点连接
+class peer_member
+  : public chat_participant
+{
+public:
+  peer_member(std::weak_ptr<peer_session> link, const std::string& room)
+    : link_(std::move(link)),
+      room_(room)
+  {
+  }
+
+  void deliver(const chat_frame_ptr& frame);
+
+  bool remote() const
+  {
+    return true;
+  }
+
+private:
+  std::weak_ptr<peer_session> link_;
+  std::string room_;
+};
+
+//接受的节点连接：读取对端的订阅，把订阅的聊天室里的本地消息发过去
+class peer_session
+  : public std::enable_shared_from_this<peer_session>
+{
+public:
+  peer_session(tcp::socket socket, chat_hall& hall)
+    : socket_(std::move(socket)),
+      hall_(hall),
+      read_buf_(max_peer_buffer),
+      idle_timer_(socket_.get_executor())
+  {
+  }
+
+  void start()
+  {
+    boost::system::error_code ignored;
+    socket_.set_option(tcp::no_delay(true), ignored);
+    do_read_line();
+  }
+//转发frame中由本节点客户端发出的消息，对端转发来的部分跳过
+//同一条frame只引用不复制，写的时候与其他待发数据一起gather写出
+//跳过的消息使编号不连续，或者消息数达到max_peer_frames时，分成多条MSG
+//对端读得太慢、积压超过max_write_queue条MSG时断开，由它重连后按编号补发
+  void forward(const std::string& room, const chat_frame_ptr& frame)
+  {
+    if (dropping_)
+      return;
+    if (write_queue_.size() >= max_write_queue)
+    {
+      dropping_ = true;//聊天室正在遍历成员，离开要推迟
+      auto self(shared_from_this());
+      boost::asio::post(socket_.get_executor(), [this, self]() { close(); });
+      return;
+    }
+    outbound out;
+    auto add = [&](const chat_frame_ptr& msg)
+    {
+      if (msg->remote())
+        return;
+      if (!out.frames.empty() && (out.frames.back()->seq() + 1 != msg->seq()
+            || out.frames.size() == max_peer_frames))
+      {
+        send(room, std::move(out));
+        out = outbound();
+      }
+      out.frames.push_back(msg);
+    };
+    if (frame->parts().empty())
+      add(frame);
+    for (const auto& part: frame->parts())
+      add(part);
+    if (!out.frames.empty())
+      send(room, std::move(out));
+  }
+
+private:
+  struct outbound
+  {
+    std::string header;
+    std::vector<chat_frame_ptr> frames;
+  };
+
+  void send(const std::string& room, outbound out)
+  {
+    std::size_t length = 0;
+    for (const auto& f: out.frames)
+      length += f->data(plain_encoding).size();
+    out.header = "MSG " + room + " " + std::to_string(length)
+      + " " + std::to_string(out.frames.front()->seq()) + "\n";
+    bool write_in_progress = !write_queue_.empty();
+    write_queue_.push_back(std::move(out));
+    if (!write_in_progress)
+      do_write();
+  }
+//不带消息的一行（ACK、PONG）
+  void send_line(const std::string& line)
+  {
+    outbound out;
+    out.header = line;
+    bool write_in_progress = !write_queue_.empty();
+    write_queue_.push_back(std::move(out));
+    if (!write_in_progress)
+      do_write();
+  }
+//对端发过PING（支持心跳）之后才检查，peer_timeout_ms内什么都没收到就断开
+  void check_idle()
+  {
+    auto self(shared_from_this());
+    idle_timer_.expires_after(std::chrono::milliseconds(peer_ping_ms));
+    idle_timer_.async_wait(
+        [this, self](boost::system::error_code ec)
+        {
+          if (ec || !socket_.is_open())
+            return;
+          if (std::chrono::steady_clock::now() - last_read_
+              >= std::chrono::milliseconds(peer_timeout_ms))
+            close();
+          else
+            check_idle();
+        });
+  }
+
+  void do_read_line()
+  {
+    auto self(shared_from_this());
+    boost::asio::async_read_until(socket_, read_buf_, '\n',
+        [this, self](boost::system::error_code ec, std::size_t length)
+        {
+          if (ec)
+          {
+            close();
+            return;
+          }
+
+          std::string line(boost::asio::buffers_begin(read_buf_.data()),
+              boost::asio::buffers_begin(read_buf_.data()) + length - 1);
+          read_buf_.consume(length);
+          last_read_ = std::chrono::steady_clock::now();
+          hall_.note_input();
+          std::istringstream in(line);
+          std::string command, room;
+          std::uint64_t value = 0;//PUB为消息长度，SUB为想要的第一条消息编号
+          in >> command >> room >> value;
+          if (command == "PING")
+          {
+            send_line("PONG\n");
+            if (!pinged_)
+            {
+              pinged_ = true;
+              check_idle();
+            }
+            do_read_line();
+            return;
+          }
+          if (!chat_hall::valid_name(room))
+          {
+            close();
+            return;
+          }
+          if (command == "PUB")
+          {
+            if (value > max_peer_payload)
+            {
+              close();
+              return;
+            }
+            do_read_payload(room, value);
+            return;
+          }
+          if (command == "SUB")
+            subscribe(room, value);
+          else if (command == "UNSUB")
+            unsubscribe(room);
+          do_read_line();
+        });
+  }
+//对端交给本节点排序的消息：当作本地消息分发，并转发给所有订阅者（包括发来的节点）
+  void do_read_payload(const std::string& room, std::size_t payload)
+  {
+    auto self(shared_from_this());
+    std::size_t buffered = read_buf_.size();
+    boost::asio::async_read(socket_, read_buf_,
+        boost::asio::transfer_exactly(payload > buffered ? payload - buffered : 0),
+        [this, self, room, payload](boost::system::error_code ec, std::size_t /*length*/)
+        {
+          if (ec)
+          {
+            close();
+            return;
+          }
+          std::string data(boost::asio::buffers_begin(read_buf_.data()),
+              boost::asio::buffers_begin(read_buf_.data()) + payload);
+          read_buf_.consume(payload);
+          if (!deliver_frames(hall_.room(room), data, false))
+          {
+            close();
+            return;
+          }
+          send_line("ACK\n");
+          do_read_line();
+        });
+  }
+
+//from不为0时先补发历史中对端错过的消息（对端重连时），再加入聊天室接收新消息
+  void subscribe(const std::string& room, std::uint64_t from)
+  {
+    std::shared_ptr<peer_member>& member = members_[room];
+    if (!member)
+    {
+      member = std::make_shared<peer_member>(shared_from_this(), room);
+      chat_room& target = hall_.room(room);
+      if (from != 0)
+        for (std::uint64_t seq = std::max(from, target.history_begin());
+            seq < target.history_end(); ++seq)
+          forward(room, target.history(seq));
+      target.join(member);
+    }
+  }
+
+  void unsubscribe(const std::string& room)
+  {
+    auto it = members_.find(room);
+    if (it != members_.end())
+    {
+      hall_.room(room).leave(it->second);
+      members_.erase(it);
+    }
+  }
+
+  void do_write()
+  {
+    write_buffers_.clear();
+    write_count_ = 0;
+    for (const auto& out: write_queue_)
+    {
+      if (write_count_ == max_gather)
+        break;
+      write_buffers_.push_back(boost::asio::buffer(out.header));
+      for (const auto& frame: out.frames)
+        write_buffers_.push_back(boost::asio::buffer(frame->data(plain_encoding)));
+      ++write_count_;
+    }
+
+    auto self(shared_from_this());
+    boost::asio::async_write(socket_, write_buffers_,
+        [this, self](boost::system::error_code ec, std::size_t /*length*/)
+        {
+          if (ec)
+          {
+            close();
+            return;
+          }
+          write_queue_.erase(write_queue_.begin(), write_queue_.begin() + write_count_);
+          if (!write_queue_.empty())
+            do_write();
+        });
+  }
+//连接断开：退出所有订阅的聊天室
+  void close()
+  {
+    for (const auto& member: members_)
+      hall_.room(member.first).leave(member.second);
+    members_.clear();
+    write_queue_.clear();
+    idle_timer_.cancel();
+    boost::system::error_code ignored;
+    socket_.close(ignored);
+  }
+
+  tcp::socket socket_;
+  chat_hall& hall_;
+  boost::asio::streambuf read_buf_;//一行没读到换行就满了时read_until出错，按出错断开
+  boost::asio::steady_timer idle_timer_;
+  std::chrono::steady_clock::time_point last_read_;
+  bool pinged_ = false;//对端发过PING
+  std::map<std::string, std::shared_ptr<peer_member>> members_;
+  std::deque<outbound> write_queue_;
+  enum { max_write_queue = 4096 };
+  bool dropping_ = false;//积压太多，正在断开
+  enum { max_gather = 64 };//一次写操作最多合并多少条MSG
+  std::vector<boost::asio::const_buffer> write_buffers_;
+  std::size_t write_count_ = 0;
+};
+
+inline void peer_member::deliver(const chat_frame_ptr& frame)
+{
+  if (auto link = link_.lock())
+    link->forward(room_, frame);
+}
+
+//主动发起的节点连接：向对端订阅它所属的、本地有成员的聊天室，把对端转发来的消息分发给本地成员
+//断开后按指数退避重连，重连后重新订阅
+class peer_link
+{
+public:
+//node为对端节点的名字（即--peer的写法 host:port），ring用来判断聊天室归属
+  peer_link(boost::asio::io_context& io_context, chat_hall& hall,
+      const hash_ring& ring, const std::string& node)
+    : resolver_(io_context),
+      socket_(io_context),
+      retry_timer_(io_context),
+      ping_timer_(io_context),
+      hall_(hall),
+      ring_(ring),
+      node_(node),
+      read_buf_(max_peer_buffer)
+  {
+    std::string::size_type colon = node.rfind(':');
+    if (colon == std::string::npos)
+      throw std::invalid_argument("peer must be host:port: " + node);
+    host_ = node.substr(0, colon);
+    port_ = node.substr(colon + 1);
+    do_connect();
+  }
+
+//聊天室有无本地成员的变化，未连接时忽略，连上时会整体重新订阅
+  void subscribe(const std::string& room, bool active)
+  {
+    if (connected_)
+      send(active ? subscribe_line(room) : "UNSUB " + room + "\n");
+  }
+//把本地客户端的消息交给归属节点，未连接时返回false
+//收到ACK之前消息留在unacked_中，连接断开时改为本地分发
+//归属节点迟迟不回ACK、积压超过max_write_queue条时断开重连，正在断开时的消息也先排进unacked_，保持顺序
+  bool publish(const std::string& room, const chat_message& msg)
+  {
+    if (!connected_)
+      return false;
+    unacked_.emplace_back(room, msg);
+    if (dropping_)
+      return true;
+    if (unacked_.size() > max_write_queue)
+    {
+      overflow();
+      return true;
+    }
+    send("PUB " + room + " " + std::to_string(msg.length()) + "\n"
+        + std::string(msg.data(), msg.length()));
+    return true;
+  }
+
+private:
+//收到过归属节点的消息时带上它的下一条编号，让对端补发断开期间错过的消息
+//不用本地的history_end()：断开期间本地分发的消息也占了编号
+  std::string subscribe_line(const std::string& room)
+  {
+    std::uint64_t end = hall_.room(room).owner_end();
+    if (end == 0)
+      return "SUB " + room + "\n";
+    return "SUB " + room + " " + std::to_string(end) + "\n";
+  }
+
+  void do_connect()
+  {
+    ++generation_;
+    unsigned generation = generation_;
+    resolver_.async_resolve(host_, port_,
+        [this, generation](boost::system::error_code ec, tcp::resolver::results_type endpoints)
+        {
+          if (ec)
+          {
+            retry(generation);
+            return;
+          }
+          boost::asio::async_connect(socket_, endpoints,
+              [this, generation](boost::system::error_code ec, tcp::endpoint)
+              {
+                if (ec)
+                {
+                  retry(generation);
+                  return;
+                }
+                boost::system::error_code ignored;
+                socket_.set_option(tcp::no_delay(true), ignored);
+                connected_ = true;
+                backoff_ = std::chrono::seconds(1);
+                last_read_ = std::chrono::steady_clock::now();
+                schedule_ping(generation);
+                for (const auto& room: hall_.active_rooms())
+                  if (ring_.owner(room) == node_)
+                    send(subscribe_line(room));
+                do_read_line(generation);
+              });
+        });
+  }
+//出错后关闭连接并稍后重连；generation防止旧连接上残留的回调影响新连接
+  void retry(unsigned generation)
+  {
+    if (generation != generation_)
+      return;
+    ++generation_;
+    connected_ = false;
+    dropping_ = false;
+    write_queue_.clear();
+    read_buf_.consume(read_buf_.size());
+    ping_timer_.cancel();
+    boost::system::error_code ignored;
+    socket_.close(ignored);
+
+    //不知道归属节点有没有收到，改为本地分发（已断开，route不会再转交）
+    std::deque<std::pair<std::string, chat_message>> unacked;
+    unacked.swap(unacked_);
+    for (const auto& pub: unacked)
+      hall_.room(pub.first).deliver(pub.second);
+
+    retry_timer_.expires_after(backoff_);
+    backoff_ = std::min<std::chrono::seconds>(backoff_ * 2, std::chrono::seconds(30));
+    retry_timer_.async_wait(
+        [this](boost::system::error_code ec)
+        {
+          if (!ec)
+            do_connect();
+        });
+  }
+
+  void do_read_line(unsigned generation)
+  {
+    boost::asio::async_read_until(socket_, read_buf_, '\n',
+        [this, generation](boost::system::error_code ec, std::size_t length)
+        {
+          if (generation != generation_)
+            return;
+          if (ec)
+          {
+            retry(generation);
+            return;
+          }
+
+          std::string line(boost::asio::buffers_begin(read_buf_.data()),
+              boost::asio::buffers_begin(read_buf_.data()) + length - 1);
+          read_buf_.consume(length);
+          last_read_ = std::chrono::steady_clock::now();
+          hall_.note_input();
+          std::istringstream in(line);
+          std::string command, room;
+          std::size_t payload = 0;
+          std::uint64_t seq = 0;
+          in >> command >> room >> payload >> seq;
+          if (command == "ACK" || command == "PONG")
+          {
+            if (command == "ACK" && !unacked_.empty())
+              unacked_.pop_front();
+            do_read_line(generation);
+            return;
+          }
+          if (command != "MSG" || !chat_hall::valid_name(room) || payload > max_peer_payload)
+          {
+            retry(generation);
+            return;
+          }
+          do_read_payload(generation, room, payload, seq);
+        });
+  }
+
+  void do_read_payload(unsigned generation, const std::string& room, std::size_t payload,
+      std::uint64_t seq)
+  {
+    std::size_t buffered = read_buf_.size();
+    boost::asio::async_read(socket_, read_buf_,
+        boost::asio::transfer_exactly(payload > buffered ? payload - buffered : 0),
+        [this, generation, room, payload, seq](boost::system::error_code ec, std::size_t /*length*/)
+        {
+          if (generation != generation_)
+            return;
+          if (ec)
+          {
+            retry(generation);
+            return;
+          }
+          //收到的消息标记为来自其他节点，只分发给本地成员
+          std::string data(boost::asio::buffers_begin(read_buf_.data()),
+              boost::asio::buffers_begin(read_buf_.data()) + payload);
+          read_buf_.consume(payload);
+          if (!deliver_frames(hall_.room(room), data, true, seq))
+          {
+            retry(generation);
+            return;
+          }
+          do_read_line(generation);
+        });
+  }
+
+//每隔peer_ping_ms发一次PING；半开的连接不会报错，peer_timeout_ms内什么都没收到就当作已断开
+  void schedule_ping(unsigned generation)
+  {
+    ping_timer_.expires_after(std::chrono::milliseconds(peer_ping_ms));
+    ping_timer_.async_wait(
+        [this, generation](boost::system::error_code ec)
+        {
+          if (ec || generation != generation_)
+            return;
+          if (std::chrono::steady_clock::now() - last_read_
+              >= std::chrono::milliseconds(peer_timeout_ms))
+          {
+            retry(generation);
+            return;
+          }
+          send("PING\n");
+          schedule_ping(generation);
+        });
+  }
 
-//----------------------------------------------------------------------
-//聊天室类
-class chat_room
+//对端读得太慢、写队列积压超过max_write_queue条时断开重连
+  void send(const std::string& line)
+  {
+    if (dropping_)
+      return;
+    if (write_queue_.size() >= max_write_queue)
+    {
+      overflow();
+      return;
+    }
+    bool write_in_progress = !write_queue_.empty();
+    write_queue_.push_back(line);
+    if (!write_in_progress)
+      do_write(generation_);
+  }
+//聊天室可能正在分发（publish()由它调用），断开改为本地分发要推迟
+  void overflow()
+  {
+    dropping_ = true;
+    unsigned generation = generation_;
+    boost::asio::post(socket_.get_executor(), [this, generation]() { retry(generation); });
+  }
+
+  void do_write(unsigned generation)
+  {
+    boost::asio::async_write(socket_, boost::asio::buffer(write_queue_.front()),
+        [this, generation](boost::system::error_code ec, std::size_t /*length*/)
+        {
+          if (generation != generation_)
+            return;
+          if (ec)
+          {
+            retry(generation);
+            return;
+          }
+          write_queue_.pop_front();
+          if (!write_queue_.empty())
+            do_write(generation);
+        });
+  }
+
+  tcp::resolver resolver_;
+  tcp::socket socket_;
+  boost::asio::steady_timer retry_timer_;
+  boost::asio::steady_timer ping_timer_;
+  std::chrono::steady_clock::time_point last_read_;//最后一次收到数据的时间
+  chat_hall& hall_;
+  const hash_ring& ring_;
+  std::string node_;
+  std::string host_;
+  std::string port_;
+  bool connected_ = false;
+  unsigned generation_ = 0;//每次建立或断开连接时加一
+  std::chrono::seconds backoff_ = std::chrono::seconds(1);
+  boost::asio::streambuf read_buf_;
+  std::deque<std::string> write_queue_;
+  std::deque<std::pair<std::string, chat_message>> unacked_;//已发出、还没收到ACK的PUB：聊天室和消息
+  enum { max_write_queue = 4096 };//写队列和unacked_各自的上限，与peer_session相同
+  bool dropping_ = false;//积压太多，正在断开
+};
+
+//节点互联的入口：监听--peer-port，连接所有--peer，并按一致性哈希决定每个聊天室的归属节点
+//给了--upstream时本节点是转发层：只持有客户端连接，聊天室全部归属上游的核心节点，
+//每个聊天室只向上游订阅一次，上游对每个转发节点只发一份，由转发节点分发给本地的所有客户端
+//在上游看来，转发节点的连接和其他核心节点一样，只是一个参与者(peer_member)
+class chat_federation
 {
 public:
-//客户端一加入服务器就会直接给该客户端发消息
-  void join(chat_participant_ptr participant)
+  chat_federation(boost::asio::io_context& io_context, chat_hall& hall,
+      const server_options& options)
+    : acceptor_(io_context),
+      hall_(hall),
+      ring_(options.vnodes),
+      node_(options.node.empty()
+          ? "127.0.0.1:" + std::to_string(options.peer_port) : options.node)
   {
-    participants_.insert(participant);
-    for (const auto& msg: recent_msgs_)
-      participant->deliver(msg);
+    if (options.peer_port > 0)
+    {
+      tcp::endpoint endpoint(tcp::v4(), options.peer_port);
+      acceptor_.open(endpoint.protocol());
+      acceptor_.set_option(tcp::acceptor::reuse_address(true));
+      acceptor_.bind(endpoint);
+      acceptor_.listen();
+      do_accept();
+    }
+
+    if (!options.upstreams.empty() && !options.peers.empty())
+      throw std::invalid_argument("--upstream and --peer cannot be used together");
+    bool relay = !options.upstreams.empty();
+    const std::vector<std::string>& nodes = relay ? options.upstreams : options.peers;
+    if (nodes.empty())
+      return;
+
+    if (!relay)
+      ring_.add(node_);//转发节点不拥有聊天室，不上环
+    for (const auto& node: nodes)
+    {
+      ring_.add(node);
+      links_[node].reset(new peer_link(io_context, hall, ring_, node));
+    }
+
+    hall_.hooks().on_interest =
+        [this](const std::string& room, bool active)
+        {
+          if (peer_link* link = owner_link(room))
+            link->subscribe(room, active);
+        };
+    hall_.hooks().route =
+        [this](const std::string& room, const chat_message& msg)
+        {
+          peer_link* link = owner_link(room);
+          return link && link->publish(room, msg);
+        };
   }
-//将客户从成员集合中去除，因为其为智能指针，会自动析构
-  void leave(chat_participant_ptr participant)
+//停止接受其他节点的连接（退出或热升级前），已有的节点连接不受影响
+  void stop_accepting()
   {
-    participants_.erase(participant);
+    boost::system::error_code ignored;
+    acceptor_.close(ignored);
   }
 
-  void deliver(const chat_message& msg)
+private:
+//聊天室归属其他节点时返回到该节点的连接，归属本节点时返回空
+  peer_link* owner_link(const std::string& room)
   {
-    recent_msgs_.push_back(msg);
-    while (recent_msgs_.size() > max_recent_msgs)
-      recent_msgs_.pop_front();
+    auto it = links_.find(ring_.owner(room));
+    return it == links_.end() ? nullptr : it->second.get();
+  }
 
-    for (auto& participant: participants_)
-      participant->deliver(msg);
+  void do_accept()
+  {
+    acceptor_.async_accept(
+        [this](boost::system::error_code ec, tcp::socket socket)
+        {
+          if (!ec)
+            std::make_shared<peer_session>(std::move(socket), hall_)->start();
+          if (acceptor_.is_open())
+            do_accept();
+        });
   }
 
-private:
-  std::set<chat_participant_ptr> participants_;
-  enum { max_recent_msgs = 100 };
-  chat_message_queue recent_msgs_;
+  tcp::acceptor acceptor_;
+  chat_hall& hall_;
+  hash_ring ring_;
+  std::string node_;//本节点的名字
+  std::map<std::string, std::unique_ptr<peer_link>> links_;//按节点名字索引
 };
 
 //----------------------------------------------------------------------
 
-class chat_session
-  : public chat_participant,
-    public std::enable_shared_from_this<chat_session>
+//已打开的socket的地址族：IPv4、IPv6或Unix域
+inline stream_protocol protocol_of(int fd)
+{
+  sockaddr_storage address;
+  socklen_t length = sizeof(address);
+  if (::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) != 0)
+    throw std::runtime_error("getsockname failed");
+  return stream_protocol(address.ss_family, address.ss_family == AF_UNIX ? 0 : IPPROTO_TCP);
+}
+//IPv4/IPv6地址转换为tcp::endpoint，Unix域地址返回false
+inline bool ip_endpoint(const stream_protocol::endpoint& endpoint, tcp::endpoint& ip)
+{
+  int family = endpoint.protocol().family();
+  if (family != AF_INET && family != AF_INET6)
+    return false;
+  ip.resize(endpoint.size());
+  std::memcpy(ip.data(), endpoint.data(), endpoint.size());
+  return true;
+}
+//命令行上的监听地址：
+//  PORT          所有IPv4地址，与原来一样
+//  HOST:PORT     指定的IP地址，IPv6地址写在方括号里；[::]:PORT 同时接受IPv4和IPv6连接（双栈）
+//  unix:PATH     Unix域socket，unix:@NAME 为抽象命名空间
+inline stream_protocol::endpoint parse_listen_address(const std::string& spec)
+{
+  if (spec.compare(0, 5, "unix:") == 0)
+    return unix_endpoint(spec.substr(5));
+  std::string::size_type colon = spec.rfind(':');
+  if (colon == std::string::npos)
+    return tcp::endpoint(tcp::v4(), static_cast<unsigned short>(std::atoi(spec.c_str())));
+  std::string host = spec.substr(0, colon);
+  if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+    host = host.substr(1, host.size() - 2);
+  return tcp::endpoint(boost::asio::ip::make_address(host),
+      static_cast<unsigned short>(std::atoi(spec.c_str() + colon + 1)));
+}
+//监听地址的规范写法，用来比较两个监听地址是否相同
+inline std::string listen_address(const stream_protocol::endpoint& endpoint)
+{
+  tcp::endpoint ip;
+  if (ip_endpoint(endpoint, ip))
+  {
+    std::ostringstream out;
+    out << ip;//IPv6地址带方括号
+    return out.str();
+  }
+  const char* path = reinterpret_cast<const sockaddr_un*>(endpoint.data())->sun_path;
+  std::size_t length = endpoint.size() - offsetof(sockaddr_un, sun_path);
+  if (length > 0 && path[0] == '\0')
+    return "unix:@" + std::string(path + 1, length - 1);
+  return "unix:" + std::string(path, ::strnlen(path, length));
+}
+
+class chat_server
 {
 public:
-  chat_session(tcp::socket socket, chat_room& room)
-    : socket_(std::move(socket)),
-      room_(room)
+//手动open/bind/listen以便指定backlog，然后同时挂起多个accept，重连风暴时不必一个一个地接收
+//连上的客户端默认加入room：TCP端口以端口号命名，不同端口的客户端互不干扰，与原来一样
+//incoming_cpu不为-1时（需要--reuse-port），在该CPU上处理的新连接优先交给这个监听socket
+  chat_server(boost::asio::io_context& io_context, chat_hall& hall,
+      const stream_protocol::endpoint& endpoint, const std::string& room,
+      const server_options& options, int incoming_cpu = -1)
+    : chat_server(hall, listen(io_context, endpoint, options, incoming_cpu), room, options)
+  {
+  }
+//热升级时接过旧进程的监听socket，listen队列里还没accept的连接也一并接过来
+  chat_server(boost::asio::io_context& io_context, chat_hall& hall,
+      int listener, const std::string& room, const server_options& options)
+    : chat_server(hall, stream_acceptor(io_context, protocol_of(listener), listener),
+        room, options)
   {
   }
+//规范写法的监听地址，见listen_address()
+  const std::string& address() const
+  {
+    return address_;
+  }
 
-  void start()
+  const std::string& room() const
+  {
+    return room_.name();
+  }
+//本端地址为local的连接是不是从这个监听socket连上来的：IP连接看端口，Unix域连接看路径
+  bool accepted(const stream_protocol::endpoint& local) const
   {
-    room_.join(shared_from_this());
-    do_read_header();
+    tcp::endpoint ip, listener;
+    if (!ip_endpoint(local, ip))
+      return listen_address(local) == address_;
+    return ip_endpoint(endpoint_, listener) && listener.port() == ip.port();
   }
 
-  void deliver(const chat_message& msg)
+  int native_handle()
   {
-    //第一次时 write_in_progress 为 false
-    //防止多次调用do_write(),因为当消息队列非空时，do_write会自己继续调用do_write()
-    //只有当消息队列为空时，才会从此处成功调用do_write()
-    bool write_in_progress = !write_msgs_.empty();  
-    write_msgs_.push_back(msg);
-    if (!write_in_progress)
+    return acceptor_.native_handle();
+  }
+//停止接受新连接，已有的连接不受影响
+  void stop()
+  {
+    boost::system::error_code ignored;
+    acceptor_.close(ignored);
+  }
+//热升级时接过旧进程交出的连接，record为chat_session::export_state()的结果
+  void adopt_session(stream_protocol::socket socket, std::istream& record, const std::string& payload)
+  {
+    make_session(std::move(socket), nullptr)->restore(record, payload);
+  }
+
+private:
+  chat_server(chat_hall& hall, stream_acceptor acceptor, const std::string& room,
+      const server_options& options)
+    : options_(options),
+      acceptor_(std::move(acceptor)),
+      endpoint_(acceptor_.local_endpoint()),
+      address_(listen_address(endpoint_)),
+      hall_(hall),
+      room_(hall.room(room).pin())
+  {
+    tcp::endpoint ip;
+    if (ip_endpoint(endpoint_, ip))//本机的Unix域socket不加密
+      tls_context_ = hall_.tls_context();
+
+    //缓冲区大小设在监听socket上，accept出来的连接继承；接收窗口的缩放因子在握手时就定了，连上之后再改不了
+    if (options_.sndbuf > 0)
+      acceptor_.set_option(boost::asio::socket_base::send_buffer_size(options_.sndbuf));
+    if (options_.rcvbuf > 0)
+      acceptor_.set_option(boost::asio::socket_base::receive_buffer_size(options_.rcvbuf));
+    acceptor_.non_blocking(true);//只影响drain_accepts()中的同步accept
+    for (int i = 0; i < options_.pending_accepts; ++i)
+      do_accept();
+  }
+
+  static stream_acceptor listen(boost::asio::io_context& io_context,
+      const stream_protocol::endpoint& endpoint, const server_options& options, int incoming_cpu)
+  {
+    stream_acceptor acceptor(io_context);
+    acceptor.open(endpoint.protocol());
+    tcp::endpoint ip;
+    if (ip_endpoint(endpoint, ip))
     {
-      //第一次
-      do_write();
+      acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+      if (ip.address().is_v6())
+        acceptor.set_option(boost::asio::ip::v6_only(false));//[::]同时接受IPv4连接
+      if (options.reuse_port)
+        acceptor.set_option(reuse_port_option(true));
+      if (incoming_cpu >= 0)
+        acceptor.set_option(incoming_cpu_option(incoming_cpu));
     }
+    else
+    {
+      std::string address = listen_address(endpoint);
+      if (address.compare(0, 6, "unix:@") != 0)
+        ::unlink(address.c_str() + 5);//上次留下的socket文件
+    }
+    acceptor.bind(endpoint);
+    acceptor.listen(options.listen_backlog);
+    return acceptor;
   }
 
-private:
-//读包头
-//将客户端信息读到buffer（read_msg_.data()）中来，读4个字节
-//当收到这四个字节时，调用回调函数
-//捕获列表self防止自己失效
-  void do_read_header()
+  void do_accept()
   {
-    auto self(shared_from_this());
-    boost::asio::async_read(socket_,
-        boost::asio::buffer(read_msg_.data(), chat_message::header_length),
-        [this, self](boost::system::error_code ec, std::size_t /*length*/) 
+    acceptor_.async_accept(
+        [this](boost::system::error_code ec, stream_protocol::socket socket)
         {
-          if (!ec && read_msg_.decode_header())//如果没有系统错误 且 头部信息合法
-          {
-            do_read_body();
-          }
-          else  //否则调用leave
+          if (!ec)
           {
-            room_.leave(shared_from_this());  //调用leave会将智能指针从set中erase,引用计数变为0，自动析构
+            start_session(std::move(socket));
+            drain_accepts();
           }
+
+          if (acceptor_.is_open())//stop()之后不再accept
+            do_accept();
         });
   }
-//读包体
-//将客户端信息读到buffer（read_msg_.body()）中来，读body_length个字节(body_length由decode_header得到)
-//当收到包体时，调用回调函数
-//捕获列表self防止自己失效
-  void do_read_body()
+//类似accept4循环：趁着这次唤醒，把listen队列里已经就绪的连接一并取出，直到would_block
+  void drain_accepts()
   {
-    auto self(shared_from_this());
-    boost::asio::async_read(socket_,
-        boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
-        [this, self](boost::system::error_code ec, std::size_t /*length*/)
-        {
-          if (!ec)//如果没有系统错误
-          {
-            room_.deliver(read_msg_);//分发消息
-            do_read_header();//读完一条读下一条
-          }
-          else//否则调用leave
+    for (int i = 1; i < options_.accept_batch; ++i)
+    {
+      boost::system::error_code ec;
+      stream_protocol::socket socket = acceptor_.accept(ec);
+      if (ec)
+        break;
+      start_session(std::move(socket));
+    }
+  }
+
+  void start_session(stream_protocol::socket socket)
+  {
+    hall_.note_input();
+    make_session(std::move(socket), tls_context_)->start();
+  }
+//本机Unix域socket上的连接不按IP合计限速，也不设TCP选项
+  std::shared_ptr<chat_session> make_session(stream_protocol::socket socket,
+      boost::asio::ssl::context* tls_context)
+  {
+    std::shared_ptr<rate_limiter> ip_limiter;
+    boost::system::error_code ec;
+    stream_protocol::endpoint remote = socket.remote_endpoint(ec);
+    tcp::endpoint peer;
+    if (!ec && ip_endpoint(remote, peer))
+    {
+      ip_limiter = hall_.ip_limiter(peer.address());
+      if (options_.busy_poll_us > 0)//读时在驱动队列上忙等这么久再睡眠，需要网卡驱动支持，设置失败时忽略
+        socket.set_option(busy_poll_option(options_.busy_poll_us), ec);
+      socket.set_option(tcp::no_delay(options_.nodelay), ec);
+      if (options_.notsent_lowat > 0)
+        socket.set_option(notsent_lowat_option(options_.notsent_lowat), ec);
+    }
+    return std::make_shared<chat_session>(std::move(socket), hall_, room_, options_,
+        std::move(ip_limiter), tls_context);
+  }
+  server_options options_;
+  boost::asio::ssl::context* tls_context_ = nullptr;//大厅共用的TLS配置，不加密时为空
+  stream_acceptor acceptor_;
+  stream_protocol::endpoint endpoint_;//监听地址
+  std::string address_;
+  chat_hall& hall_;
+  chat_room& room_;//默认聊天室
+};
+
+//----------------------------------------------------------------------
+//共享内存输入：同一台机器上发消息很频繁的程序（如行情机器人）把消息直接写进共享内存里的环形缓冲区，
+//服务器定时取出，像客户端发来的一样交给聊天室分发。生产者一侧没有系统调用，消费者一次取一批
+//环里有数据时取完一批立即再取，空了才按--shm-poll-us等待，所以高频时延迟接近忙等，空闲时几乎不占CPU
+//生产者是本机可信的程序，不限速，也不走压缩；环里的压缩消息和以/开头的命令不分发，丢弃时记日志
+class shm_feed
+{
+public:
+//spec为 <聊天室>:<文件>
+  shm_feed(boost::asio::io_context& io_context, chat_hall& hall, const std::string& spec,
+      const server_options& options)
+    : hall_(hall),
+      room_(hall.room(room_name(spec)).pin()),
+      ring_(spec.substr(spec.find(':') + 1), static_cast<std::size_t>(options.shm_size)),
+      interval_(options.shm_poll_us),
+      timer_(io_context)
+  {
+    poll();
+  }
+//停止读取，环里剩下的留给下一个进程
+  void stop()
+  {
+    stopped_ = true;
+    timer_.cancel();
+  }
+
+private:
+  static std::string room_name(const std::string& spec)
+  {
+    std::string::size_type colon = spec.find(':');
+    if (colon == std::string::npos || !chat_hall::valid_name(spec.substr(0, colon)))
+      throw std::runtime_error("bad --shm: " + spec);
+    return spec.substr(0, colon);
+  }
+
+  void poll()
+  {
+    std::size_t count = 0, compressed = 0, commands = 0;
+    try
+    {
+      count = ring_.pop(
+          [this, &compressed, &commands](const chat_message& msg)
           {
-            room_.leave(shared_from_this()); //调用leave会释放资源
-          }
-        });
+            if (msg.compressed())
+              ++compressed;
+            else if (msg.body_length() > 0 && msg.body()[0] == '/')
+              ++commands;
+            else
+              room_.deliver(msg);
+          }, max_batch);
+    }
+    catch (std::exception& e)
+    {
+      std::cerr << "Stop reading shared memory for " << room_.name() << ": " << e.what() << "\n";
+      return;
+    }
+    if (count > 0)
+      hall_.note_input();
+    if (compressed + commands > 0)
+      std::cerr << "Shared memory for " << room_.name() << ": dropped " << compressed
+        << " compressed and " << commands << " command messages\n";
+
+    if (count == max_batch)//还有，让其他回调先跑一下再接着取
+      boost::asio::post(timer_.get_executor(), [this]() { if (!stopped_) poll(); });
+    else
+      wait();
   }
-//异步写
-//将队列头部第一条信息写到buffer
-  void do_write()
+
+  void wait()
   {
-    auto self(shared_from_this());//防止被析构
-    boost::asio::async_write(socket_,
-        boost::asio::buffer(write_msgs_.front().data(),
-          write_msgs_.front().length()),
-        [this, self](boost::system::error_code ec, std::size_t /*length*/)
+    timer_.expires_after(interval_);
+    timer_.async_wait(
+        [this](boost::system::error_code ec)
         {
-          if (!ec)  //如果没有发生错误
-          {
-            write_msgs_.pop_front();  //去除消息队列的第一条消息
-            if (!write_msgs_.empty()) //如果非空
-            {
-              do_write(); //继续写
-            }
-          }
-          else  //发生错误（一般网络问题，客户端出错）
-          {
-            room_.leave(shared_from_this());  //析构释放资源
-          }
+          if (!ec && !stopped_)
+            poll();
         });
   }
 
-  tcp::socket socket_;
-  chat_room& room_;//通过引用说明chat_room生命周期更长
-  chat_message read_msg_;
-  chat_message_queue write_msgs_; 
-  //deque优点，在头部删除元素和尾部插入数据不会引起迭代器失效和内存分配
-  //vector缺点，在头部删除元素非常耗时，且不提供pop_front()接口，且
-  //在不断push_back()时可能导致内存重新分配，因为vector要保证内存连续性
-  //list在此处也可行，但deque更省内存，且遍历时list更慢些
+  enum { max_batch = 1024 };//一次最多取多少条
+  chat_hall& hall_;
+  chat_room& room_;
+  shm_ring ring_;
+  std::chrono::microseconds interval_;
+  boost::asio::steady_timer timer_;
+  bool stopped_ = false;
 };
 
 //----------------------------------------------------------------------
-
-class chat_server
+//进程的退出和热升级
+//SIGTERM/SIGINT：排空——停止接受新的客户端和节点连接，已有连接照常工作，
+//全部断开或--drain-timeout到期后退出；排空期间再收到一次立即退出
+//--handoff=PATH：新进程带着--takeover=PATH启动后连上来，旧进程依次交出
+//  LISTEN <聊天室>               监听socket（附描述符）和它的默认聊天室，旧进程随即不再accept，listen队列里的连接由新进程接着accept
+//  ROOM <聊天室> <history_end> <owner_end>   聊天室历史（首尾相接的消息），编号不变，客户端的 /resume 和节点的 SUB 照常续上
+//                               owner_end见chat_room::owner_end()，旧版本没有这一项时按0处理
+//  SESSION ...                  普通TCP连接（附描述符）和会话状态，见chat_session::export_state()
+//  END
+//然后旧进程退出。交出的连接客户端毫无察觉；TLS连接、暂存中和刚连上还没加入聊天室的连接随旧进程关闭，
+//客户端重连到新进程后按编号恢复，不会丢消息
+class server_lifecycle
 {
 public:
-  chat_server(boost::asio::io_context& io_context,
-      const tcp::endpoint& endpoint)
-    : acceptor_(io_context, endpoint)
+  using local_protocol = boost::asio::local::stream_protocol;
+
+  server_lifecycle(boost::asio::io_context& io_context, chat_hall& hall,
+      chat_federation& federation, std::list<chat_server>& servers, std::list<shm_feed>& feeds,
+      const server_options& options)
+    : io_context_(io_context),
+      hall_(hall),
+      federation_(federation),
+      servers_(servers),
+      feeds_(feeds),
+      drain_timeout_(options.drain_timeout),
+      signals_(io_context, SIGINT, SIGTERM),
+      timer_(io_context),
+      handoff_acceptor_(io_context)
   {
-    do_accept();
+    wait_signal();
+    if (!options.handoff.empty())
+    {
+      ::unlink(options.handoff.c_str());//上次留下的，或者刚被本进程接管的旧进程的
+      local_protocol::endpoint endpoint(options.handoff);
+      handoff_acceptor_.open(endpoint.protocol());
+      handoff_acceptor_.bind(endpoint);
+      handoff_acceptor_.listen();
+      handoff_acceptor_.async_accept(
+          [this](boost::system::error_code ec, local_protocol::socket connection)
+          {
+            if (!ec)
+              hand_over(std::move(connection));
+          });
+    }
   }
 
 private:
-  void do_accept()
+  void wait_signal()
   {
-    acceptor_.async_accept(
-        [this](boost::system::error_code ec, tcp::socket socket)
+    signals_.async_wait(
+        [this](boost::system::error_code ec, int /*signal*/)
+        {
+          if (ec)
+            return;
+          drain();
+          wait_signal();
+        });
+  }
+
+  void drain()
+  {
+    if (draining_)
+    {
+      io_context_.stop();
+      return;
+    }
+    draining_ = true;
+    stop_accepting();
+    deadline_ = std::chrono::steady_clock::now() + drain_timeout_;
+    check_drained();
+  }
+//只剩节点连接时事件循环不会自己结束，所以定期检查还有没有客户端会话
+  void check_drained()
+  {
+    if (*hall_.live_sessions() == 0
+        || (drain_timeout_.count() > 0 && std::chrono::steady_clock::now() >= deadline_))
+    {
+      io_context_.stop();
+      return;
+    }
+    timer_.expires_after(std::chrono::milliseconds(drain_poll_ms));
+    timer_.async_wait(
+        [this](boost::system::error_code ec)
         {
           if (!ec)
+            check_drained();
+        });
+  }
+
+  void stop_accepting()
+  {
+    for (auto& server: servers_)
+      server.stop();
+    for (auto& feed: feeds_)
+      feed.stop();
+    federation_.stop_accepting();
+    boost::system::error_code ignored;
+    handoff_acceptor_.close(ignored);
+  }
+//先交出监听socket，再冻结所有能交出的会话，等它们的读写都停下（或超时）后交出历史和连接
+  void hand_over(local_protocol::socket connection)
+  {
+    if (draining_)
+      return;
+    draining_ = true;
+    connection_ = std::move(connection);
+    try
+    {
+      federation_.stop_accepting();//让新进程能绑定--peer-port
+      for (auto& server: servers_)
+      {
+        handoff_record listener;
+        listener.header = "LISTEN " + server.room();
+        listener.fd = server.native_handle();
+        send_record(connection_.native_handle(), listener);
+      }
+    }
+    catch (std::exception& e)
+    {
+      std::cerr << "Handoff failed: " << e.what() << "\n";
+    }
+    stop_accepting();
+
+    pending_ = 1;//防止冻结在循环中途同步完成
+    for (chat_room* room: hall_.rooms())
+      room->members().for_each(
+          [this](std::uint32_t id)
           {
-            std::make_shared<chat_session>(std::move(socket), room_)->start();
-          }
+            //会话同时只在一个聊天室里；已经冻结过的freeze()返回false，不会重复
+            if (auto session = std::dynamic_pointer_cast<chat_session>(hall_.member(id)))
+            {
+              ++pending_;
+              if (session->freeze([this]() { frozen_one(); }))
+                frozen_.push_back(session);
+              else
+                --pending_;
+            }
+          });
 
-          do_accept();
+    timer_.expires_after(std::chrono::milliseconds(freeze_timeout_ms));
+    timer_.async_wait(
+        [this](boost::system::error_code ec)
+        {
+          if (!ec)
+            finish_handoff();//写不动的慢客户端不等了，随旧进程关闭
         });
+    frozen_one();
   }
 
-  tcp::acceptor acceptor_;
-  chat_room room_;
+  void frozen_one()
+  {
+    if (--pending_ == 0)
+      finish_handoff();
+  }
+
+  void finish_handoff()
+  {
+    if (handed_off_)
+      return;
+    handed_off_ = true;
+    timer_.cancel();
+
+    int sock = connection_.native_handle();
+    try
+    {
+      for (chat_room* room: hall_.rooms())
+        room->flush();
+      for (chat_room* room: hall_.rooms())
+      {
+        if (room->history_end() <= 1)
+          continue;
+        handoff_record history;
+        history.header = "ROOM " + room->name() + " " + std::to_string(room->history_end())
+          + " " + std::to_string(room->owner_end());
+        for (std::uint64_t seq = room->history_begin(); seq < room->history_end(); ++seq)
+          history.payload += room->history(seq)->data(plain_encoding);
+        send_record(sock, history);
+      }
+      for (auto& session: frozen_)
+      {
+        if (!session->transferable())
+          continue;
+        handoff_record record;
+        record.header = session->export_state(record.payload);
+        record.fd = session->native_handle();
+        send_record(sock, record);
+        session->release();
+      }
+      handoff_record end;
+      end.header = "END";
+      send_record(sock, end);
+    }
+    catch (std::exception& e)
+    {
+      std::cerr << "Handoff failed: " << e.what() << "\n";
+    }
+    io_context_.stop();
+  }
+
+  boost::asio::io_context& io_context_;
+  chat_hall& hall_;
+  chat_federation& federation_;
+  std::list<chat_server>& servers_;
+  std::list<shm_feed>& feeds_;
+  std::chrono::seconds drain_timeout_;
+  std::chrono::steady_clock::time_point deadline_;
+  enum { drain_poll_ms = 200 };
+  enum { freeze_timeout_ms = 2000 };//交接时最多等多久让正在进行的写完成
+  boost::asio::signal_set signals_;
+  boost::asio::steady_timer timer_;
+  local_protocol::acceptor handoff_acceptor_;
+  local_protocol::socket connection_{io_context_};//与新进程的连接，只用阻塞读写
+  bool draining_ = false;
+  bool handed_off_ = false;
+  std::size_t pending_ = 0;//还没停下读写的会话数
+  std::vector<std::shared_ptr<chat_session>> frozen_;
 };
 
+//新进程：连上旧进程的--handoff socket，收下它交出的所有记录
+//旧进程中途出错时记录不完整，照样用收到的部分（至少监听socket要接过来，旧进程已经不再accept了）
+inline std::vector<handoff_record> take_over(boost::asio::io_context& io_context,
+    const std::string& path)
+{
+  boost::asio::local::stream_protocol::socket socket(io_context);
+  socket.connect(boost::asio::local::stream_protocol::endpoint(path));
+  std::vector<handoff_record> records;
+  handoff_record record;
+  while (recv_record(socket.native_handle(), record))
+  {
+    if (record.header == "END")
+      return records;
+    records.push_back(record);
+  }
+  std::cerr << "Handoff incomplete, continuing with what was received\n";
+  return records;
+}
+
+//按收到的记录恢复：先接过监听socket和聊天室历史，最后接过连接（连接要加入的聊天室已经有历史了）
+inline void inherit(std::vector<handoff_record>& records, boost::asio::io_context& io_context,
+    chat_hall& hall, std::list<chat_server>& servers, const server_options& options)
+{
+  for (auto& record: records)
+  {
+    std::istringstream in(record.header);
+    std::string kind;
+    in >> kind;
+    if (kind == "LISTEN" && record.fd >= 0)
+    {
+      int fd = record.fd;
+      record.fd = -1;
+      std::string room;
+      in >> room;
+      servers.emplace_back(io_context, hall, fd, chat_hall::valid_name(room) ? room : "local", options);
+    }
+    else if (kind == "ROOM")
+    {
+      std::string name;
+      std::uint64_t end = 0, owner_end = 0;
+      std::vector<chat_message> msgs;
+      in >> name >> end >> owner_end;
+      if (!chat_hall::valid_name(name) || !split_frames(record.payload, msgs))
+        continue;
+      std::vector<chat_frame_ptr> frames;
+      for (const auto& msg: msgs)
+        frames.push_back(make_frame(msg));
+      hall.room(name).restore_history(end, owner_end, frames);
+    }
+  }
+
+  for (auto& record: records)
+  {
+    std::istringstream in(record.header);
+    std::string kind;
+    in >> kind;
+    if (kind != "SESSION" || record.fd < 0)
+      continue;
+    try
+    {
+      int fd = record.fd;
+      record.fd = -1;
+      stream_protocol::socket socket(io_context, protocol_of(fd), fd);
+      stream_protocol::endpoint local = socket.local_endpoint();
+      for (auto& server: servers)
+        if (server.accepted(local))
+        {
+          server.adopt_session(std::move(socket), in, record.payload);
+          break;
+        }
+    }
+    catch (std::exception& e)
+    {
+      std::cerr << "Cannot restore session: " << e.what() << "\n";
+    }
+  }
+
+  for (auto& record: records)//没用上的描述符
+    if (record.fd >= 0)
+      ::close(record.fd);
+}
+
 //----------------------------------------------------------------------
 
 int main(int argc, char* argv[])
 {
   try
   {
-    if (argc < 2)
+    server_options options;
+    std::vector<std::string> addresses;
+    for (int i = 1; i < argc; ++i)
+    {
+      std::string arg = argv[i];
+      if (arg.compare(0, 2, "--") == 0)
+      {
+        if (!parse_option(arg, options))
+        {
+          std::cerr << "Unknown option: " << arg << "\n";
+          return 1;
+        }
+      }
+      else
+      {
+        addresses.push_back(arg);
+      }
+    }
+
+    if (addresses.empty() && options.takeover.empty())
     {
-      std::cerr << "Usage: chat_server <port> [<port> ...]\n";
+      std::cerr << "Usage: chat_server [--accepts=N] [--backlog=N] [--accept-batch=N]"
+        " [--msg-rate=N] [--byte-rate=N] [--ip-msg-rate=N] [--ip-byte-rate=N]"
+        " [--coalesce-ms=N] [--coalesce-bytes=N] [--deflate=1] [--dict=FILE]"
+        " [--tls-cert=FILE --tls-key=FILE] [--ktls=1]"
+        " [--peer-port=N] [--peer=HOST:PORT ...] [--node=HOST:PORT] [--vnodes=N]"
+        " [--upstream=HOST:PORT ...] [--resume-grace=SECONDS]"
+        " [--ping-interval=SECONDS] [--read-timeout=SECONDS]"
+        " [--drain-timeout=SECONDS] [--handoff=PATH] [--takeover=PATH]"
+        " [--busy-poll=1] [--busy-poll-us=N] [--cpu=N] [--numa-node=N|IFNAME] [--reuse-port=1]"
+        " [--nodelay=0] [--sndbuf=N] [--rcvbuf=N] [--notsent-lowat=N] [--cork=1]"
+        " [--shm=ROOM:FILE ...] [--shm-size=N] [--shm-poll-us=N] [--presence-ms=N] [--max-rooms=N]"
+        " [--room-linger=SECONDS]"
+        " <port>|<host>:<port>|unix:<path> ...\n"
+        "  --numa-node pins the whole process and sets a process-wide MPOL_PREFERRED memory policy;\n"
+        "  the per-CPU listeners of --reuse-port share one event loop, so they only help when\n"
+        "  one process runs per NUMA node\n";
       return 1;
     }
 
+    //先绑核、设内存策略，再创建任何对象，之后分配的内存都在本地节点上
+    std::vector<int> local_cpus;//--numa-node所在节点的CPU
+    if (!options.numa_node.empty())
+    {
+      int node = resolve_numa_node(options.numa_node);
+      local_cpus = numa_node_cpus(node);
+      prefer_numa_node(node);
+    }
+    if (options.cpu >= 0)
+      pin_thread(std::vector<int>(1, options.cpu));
+    else if (!local_cpus.empty())
+      pin_thread(local_cpus);
+
     boost::asio::io_context io_context;
+    chat_hall hall(io_context, options);
+    std::vector<handoff_record> inherited;
+    if (!options.takeover.empty())
+      inherited = take_over(io_context, options.takeover);//旧进程交出--peer-port之后才能创建节点互联
+    chat_federation federation(io_context, hall, options);
 
     std::list<chat_server> servers;
-    for (int i = 1; i < argc; ++i)
+    inherit(inherited, io_context, hall, servers, options);
+    //TCP端口的默认聊天室以端口号命名；Unix域socket给同一台机器上的程序用，默认加入第一个TCP端口的聊天室
+    std::string local_room = "local";
+    for (const auto& address: addresses)
+    {
+      tcp::endpoint ip;
+      if (ip_endpoint(parse_listen_address(address), ip))
+      {
+        local_room = std::to_string(ip.port());
+        break;
+      }
+    }
+    for (const auto& address: addresses)
     {
-      tcp::endpoint endpoint(tcp::v4(), std::atoi(argv[i]));
-      servers.emplace_back(io_context, endpoint);
+      stream_protocol::endpoint endpoint = parse_listen_address(address);
+      bool inherited_address = false;
+      for (const auto& server: servers)
+        inherited_address = inherited_address || server.address() == listen_address(endpoint);
+      if (inherited_address)
+        continue;
+      tcp::endpoint ip;
+      if (!ip_endpoint(endpoint, ip))
+      {
+        servers.emplace_back(io_context, hall, endpoint, local_room, options);
+        continue;
+      }
+      std::string room = std::to_string(ip.port());
+      if (!options.reuse_port || local_cpus.empty())
+      {
+        servers.emplace_back(io_context, hall, endpoint, room, options);
+        continue;
+      }
+      //每个本地CPU一个监听socket：网卡中断落在哪个CPU上，连接就交给那个CPU所在节点的进程，
+      //会话内存与收包的CPU在同一个节点上。这些socket共用一个io_context，进程内并不按CPU区分，
+      //只有每个NUMA节点各跑一个进程时才有意义：别的节点上收的连接不会落到本进程
+      for (int cpu: local_cpus)
+        servers.emplace_back(io_context, hall, endpoint, room, options, cpu);
     }
 
-    io_context.run();
+    std::list<shm_feed> feeds;
+    for (const auto& spec: options.shm_rings)
+      feeds.emplace_back(io_context, hall, spec, options);
+
+    server_lifecycle lifecycle(io_context, hall, federation, servers, feeds, options);
+    if (options.busy_poll)
+    {
+      //没有就绪的回调时poll()立即返回，不在epoll_wait里睡眠，省掉唤醒和调度
+      //连续busy_poll_idle次poll()都没有新的输入（见chat_hall::note_input()）时退回阻塞等待，
+      //直到有输入才重新空转；时间轮的tick和心跳这类定时器只把它唤醒一次，空闲时不占CPU
+      //没有任何待处理的工作时io_context自己停止
+      enum { busy_poll_idle = 20000 };
+      unsigned idle = 0;
+      std::uint64_t inputs = hall.inputs();
+      while (!io_context.stopped())
+      {
+        if (idle < busy_poll_idle)
+        {
+          io_context.poll();
+          ++idle;
+        }
+        else
+        {
+          io_context.run_one_for(std::chrono::seconds(1));
+        }
+        if (hall.inputs() != inputs)
+        {
+          inputs = hall.inputs();
+          idle = 0;
+        }
+      }
+    }
+    else
+    {
+      io_context.run();
+    }
   }
   catch (std::exception& e)
   {
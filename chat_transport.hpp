@@ -0,0 +1,223 @@
+//
+// chat_transport.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CHAT_TRANSPORT_HPP
+#define CHAT_TRANSPORT_HPP
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <utility>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+
+// 一个连接的传输层：普通TCP或Unix域socket，或者TCP之上的TLS
+// 服务器和客户端都只通过它读写，不关心下面是不是加密的、是哪种socket
+class chat_transport
+{
+public:
+  using socket_type = boost::asio::generic::stream_protocol::socket;//tcp::socket和local::stream_protocol::socket都可以转换过来
+  using tls_stream = boost::asio::ssl::stream<socket_type>;
+
+  explicit chat_transport(socket_type socket)
+    : socket_(std::move(socket))
+  {
+  }
+//切换为TLS，必须在握手和任何读写之前调用
+  void use_tls(boost::asio::ssl::context& context)
+  {
+    tls_.reset(new tls_stream(std::move(socket_), context));
+  }
+
+  bool tls() const
+  {
+    return tls_ != nullptr;
+  }
+
+  socket_type& socket()
+  {
+    return tls_ ? tls_->next_layer() : socket_;
+  }
+
+  SSL* native_handle()
+  {
+    return tls_ ? tls_->native_handle() : nullptr;
+  }
+
+  template <typename Handler>
+  void async_handshake(boost::asio::ssl::stream_base::handshake_type type,
+      Handler handler)
+  {
+    tls_->async_handshake(type, std::move(handler));
+  }
+//握手完成后调用：如果OpenSSL已经把发送方向的加密交给了内核(kTLS)，
+//之后直接把明文写到socket上，由内核加密，gather写(writev)和内核的零拷贝路径照常可用
+  bool check_ktls()
+  {
+    ktls_send_ = tls_ && BIO_get_ktls_send(SSL_get_wbio(tls_->native_handle()));
+    return ktls_send_;
+  }
+
+  template <typename Buffers, typename Handler>
+  void async_read(const Buffers& buffers, Handler handler)
+  {
+    if (tls_)
+      boost::asio::async_read(*tls_, buffers, std::move(handler));
+    else
+      boost::asio::async_read(socket_, buffers, std::move(handler));
+  }
+//读到多少算多少，一次系统调用（或一个TLS record）里有几条消息就拿到几条
+  template <typename Buffers, typename Handler>
+  void async_read_some(const Buffers& buffers, Handler handler)
+  {
+    if (tls_)
+      tls_->async_read_some(buffers, std::move(handler));
+    else
+      socket_.async_read_some(buffers, std::move(handler));
+  }
+//同一时刻只能有一个写操作
+//用户态TLS每次SSL_write生成一个record，所以先把多个buffer拼成一块，一次加密、一次系统调用
+  template <typename Buffers, typename Handler>
+  void async_write(const Buffers& buffers, Handler handler)
+  {
+    if (!tls_ || ktls_send_)
+    {
+      boost::asio::async_write(socket(), buffers, std::move(handler));
+      return;
+    }
+
+    write_buffer_.resize(boost::asio::buffer_size(buffers));
+    boost::asio::buffer_copy(boost::asio::buffer(&write_buffer_[0], write_buffer_.size()),
+        buffers);
+    boost::asio::async_write(*tls_, boost::asio::buffer(write_buffer_),
+        std::move(handler));
+  }
+
+  void close()
+  {
+    boost::system::error_code ignored;
+    socket().close(ignored);
+  }
+
+private:
+  socket_type socket_;
+  std::unique_ptr<tls_stream> tls_;
+  bool ktls_send_ = false;
+  std::string write_buffer_;
+};
+
+//----------------------------------------------------------------------
+
+// Unix域socket地址：path以@开头时为抽象命名空间（不在文件系统中创建文件，进程退出后自动消失）
+inline boost::asio::local::stream_protocol::endpoint unix_endpoint(const std::string& path)
+{
+  if (!path.empty() && path[0] == '@')
+    return boost::asio::local::stream_protocol::endpoint(std::string(1, '\0') + path.substr(1));
+  return boost::asio::local::stream_protocol::endpoint(path);
+}
+
+//----------------------------------------------------------------------
+
+// 服务器端TLS配置
+// 开启会话缓存和会话票据，重连的客户端可以用上次的票据恢复会话，省掉证书签名等大部分握手计算
+// ktls为true时请求OpenSSL在握手后把对称加密交给内核（需要内核tls模块，否则自动退回用户态）
+inline void configure_tls_server(boost::asio::ssl::context& context,
+    const std::string& cert_file, const std::string& key_file, bool ktls)
+{
+  context.set_options(boost::asio::ssl::context::default_workarounds
+      | boost::asio::ssl::context::no_sslv2
+      | boost::asio::ssl::context::no_sslv3
+      | boost::asio::ssl::context::no_tlsv1
+      | boost::asio::ssl::context::no_tlsv1_1);
+  context.use_certificate_chain_file(cert_file);
+  context.use_private_key_file(key_file, boost::asio::ssl::context::pem);
+
+  SSL_CTX* native = context.native_handle();
+  static const unsigned char session_id_context[] = "chat";
+  SSL_CTX_set_session_id_context(native, session_id_context, sizeof(session_id_context) - 1);
+  SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_clear_options(native, SSL_OP_NO_TICKET);
+#ifdef SSL_OP_ENABLE_KTLS
+  if (ktls)
+    SSL_CTX_set_options(native, SSL_OP_ENABLE_KTLS);
+#else
+  (void)ktls;
+#endif
+}
+
+// SSL_CTX上保存会话文件路径的ex_data下标（app_data已被asio的ssl::context占用）
+inline int tls_session_file_index()
+{
+  static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return index;
+}
+
+// 客户端收到新的会话票据时保存到文件，下次启动时用它恢复会话
+inline int save_tls_session(SSL* ssl, SSL_SESSION* session)
+{
+  const std::string* path = static_cast<const std::string*>(
+      SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), tls_session_file_index()));
+  if (path && !path->empty())
+  {
+    if (FILE* file = std::fopen(path->c_str(), "w"))
+    {
+      PEM_write_SSL_SESSION(file, session);
+      std::fclose(file);
+    }
+  }
+  return 0;//不接管session的所有权
+}
+
+// 客户端TLS配置
+// 校验服务器证书链和证书中的主机名（host，域名或IP地址）；ca_file为空时用系统默认的CA
+// insecure为true时完全不校验（本地自签名证书测试用），只能显式指定
+// session_file不为空时，收到的会话票据都写入该文件（session_file需比context活得长）
+inline void configure_tls_client(boost::asio::ssl::context& context, const std::string& host,
+    const std::string& ca_file, bool insecure, const std::string* session_file)
+{
+  if (insecure)
+  {
+    context.set_verify_mode(boost::asio::ssl::verify_none);
+  }
+  else
+  {
+    if (ca_file.empty())
+      context.set_default_verify_paths();
+    else
+      context.load_verify_file(ca_file);
+    context.set_verify_mode(boost::asio::ssl::verify_peer);
+    context.set_verify_callback(boost::asio::ssl::host_name_verification(host));
+  }
+
+  SSL_CTX* native = context.native_handle();
+  if (session_file)
+  {
+    SSL_CTX_set_ex_data(native, tls_session_file_index(), const_cast<std::string*>(session_file));
+    SSL_CTX_set_session_cache_mode(native,
+        SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(native, save_tls_session);
+  }
+}
+
+// 握手前调用：读取之前保存的会话，握手时尝试恢复；文件不存在或已失效时照常完整握手
+inline void load_tls_session(SSL* ssl, const std::string& session_file)
+{
+  if (FILE* file = std::fopen(session_file.c_str(), "r"))
+  {
+    if (SSL_SESSION* session = PEM_read_SSL_SESSION(file, nullptr, nullptr, nullptr))
+    {
+      SSL_set_session(ssl, session);
+      SSL_SESSION_free(session);
+    }
+    std::fclose(file);
+  }
+}
+
+#endif // CHAT_TRANSPORT_HPP
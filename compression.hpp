@@ -0,0 +1,141 @@
+//
+// compression.hpp
+// ~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef COMPRESSION_HPP
+#define COMPRESSION_HPP
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <zlib.h>
+#include "chat_message.hpp"
+
+// 消息包体的deflate压缩（raw deflate，不带zlib头尾）
+// 每条消息单独压缩，不依赖之前的消息，所以同一条消息压缩一次就可以发给所有协商了压缩的连接
+// 可以指定一个预置字典（用常见聊天内容训练出来的文本），两端字典必须相同，用dictionary_id()核对
+// z_stream只初始化一次，之后每条消息reset后复用，避免每次分配压缩窗口
+// 有字典时另有一个只装了字典的压缩流primed_，每条消息从它deflateCopy出来，不用每次重新给字典建哈希链
+//（deflateSetDictionary的开销随字典长度增长，32KB的字典比压缩一条消息本身还慢几倍，复制的开销是固定的）
+// 压缩级别用默认的6：消息很短，最高级别多花的时间几乎换不来更小的输出
+class deflate_codec
+{
+public:
+  explicit deflate_codec(const std::string& dictionary = std::string())
+    : dictionary_(dictionary)
+  {
+    std::memset(&deflate_, 0, sizeof(deflate_));
+    std::memset(&primed_, 0, sizeof(primed_));
+    std::memset(&inflate_, 0, sizeof(inflate_));
+    if (deflateInit2(&deflate_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+          Z_DEFAULT_STRATEGY) != Z_OK)
+      throw std::runtime_error("deflateInit2 failed");
+    if (!dictionary_.empty())
+    {
+      if (deflateInit2(&primed_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+            Z_DEFAULT_STRATEGY) != Z_OK)
+      {
+        deflateEnd(&deflate_);
+        throw std::runtime_error("deflateInit2 failed");
+      }
+      deflateSetDictionary(&primed_,
+          reinterpret_cast<const Bytef*>(dictionary_.data()),
+          static_cast<uInt>(dictionary_.size()));
+    }
+    if (inflateInit2(&inflate_, -15) != Z_OK)
+    {
+      deflateEnd(&deflate_);
+      deflateEnd(&primed_);
+      throw std::runtime_error("inflateInit2 failed");
+    }
+  }
+
+  ~deflate_codec()
+  {
+    deflateEnd(&deflate_);
+    deflateEnd(&primed_);//没有字典时没有初始化，deflateEnd直接返回错误
+    inflateEnd(&inflate_);
+  }
+
+  deflate_codec(const deflate_codec&) = delete;
+  deflate_codec& operator=(const deflate_codec&) = delete;
+//从文件读取字典，文件不存在时抛异常
+  static std::string load_dictionary(const std::string& path)
+  {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+      throw std::runtime_error("cannot open dictionary " + path);
+    return std::string(std::istreambuf_iterator<char>(file),
+        std::istreambuf_iterator<char>());
+  }
+//字典的adler32，没有字典时为0，协商压缩时双方用它确认字典一致
+  unsigned long dictionary_id() const
+  {
+    if (dictionary_.empty())
+      return 0;
+    return adler32(adler32(0, Z_NULL, 0),
+        reinterpret_cast<const Bytef*>(dictionary_.data()),
+        static_cast<uInt>(dictionary_.size()));
+  }
+//压缩msg的包体到out，压缩后不比原来小时返回false，此时应直接发送原消息
+  bool compress(const chat_message& msg, chat_message& out)
+  {
+    if (dictionary_.empty())
+    {
+      deflateReset(&deflate_);
+    }
+    else
+    {
+      deflateEnd(&deflate_);
+      if (deflateCopy(&deflate_, &primed_) != Z_OK)
+        return false;//内存不够，这条不压缩，下一条再复制
+    }
+
+    deflate_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(msg.body()));
+    deflate_.avail_in = static_cast<uInt>(msg.body_length());
+    deflate_.next_out = reinterpret_cast<Bytef*>(out.body());
+    deflate_.avail_out = static_cast<uInt>(msg.body_length() ? msg.body_length() - 1 : 0);
+    if (deflate(&deflate_, Z_FINISH) != Z_STREAM_END)
+      return false;//输出空间不够，说明压缩没有收益
+
+    out.body_length(msg.body_length() - 1 - deflate_.avail_out);
+    out.compressed(true);
+    out.encode_header();
+    return true;
+  }
+//解压缩msg的包体到out，数据损坏或解压后超过最大长度时返回false
+  bool decompress(const chat_message& msg, chat_message& out)
+  {
+    inflateReset(&inflate_);
+    if (!dictionary_.empty())
+      inflateSetDictionary(&inflate_,
+          reinterpret_cast<const Bytef*>(dictionary_.data()),
+          static_cast<uInt>(dictionary_.size()));
+
+    inflate_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(msg.body()));
+    inflate_.avail_in = static_cast<uInt>(msg.body_length());
+    inflate_.next_out = reinterpret_cast<Bytef*>(out.body());
+    inflate_.avail_out = chat_message::max_body_length;
+    if (inflate(&inflate_, Z_FINISH) != Z_STREAM_END)
+      return false;
+
+    out.body_length(chat_message::max_body_length - inflate_.avail_out);
+    out.compressed(false);
+    out.encode_header();
+    return true;
+  }
+
+private:
+  std::string dictionary_;
+  z_stream deflate_;
+  z_stream primed_;//已设置字典、从未压缩过数据的压缩流，只在有字典时使用
+  z_stream inflate_;
+};
+
+#endif // COMPRESSION_HPP
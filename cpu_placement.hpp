@@ -0,0 +1,107 @@
+//
+// cpu_placement.hpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CPU_PLACEMENT_HPP
+#define CPU_PLACEMENT_HPP
+
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// 线程绑核与NUMA内存策略，只用sysfs和系统调用，不依赖libnuma
+// 服务器每个进程只有一个事件循环线程，多路NUMA的机器上每个节点跑一个进程、彼此用节点互联，
+// 进程启动时先绑到本节点的CPU并让内存优先从本节点分配，之后创建的会话、消息和缓冲区都在本地内存上
+
+//解析sysfs中的CPU列表，如 "0-3,8,10-11"
+inline std::vector<int> parse_cpu_list(const std::string& list)
+{
+  std::vector<int> cpus;
+  std::string::size_type pos = 0;
+  while (pos < list.size())
+  {
+    std::string::size_type end = list.find(',', pos);
+    if (end == std::string::npos)
+      end = list.size();
+    std::string range = list.substr(pos, end - pos);
+    std::string::size_type dash = range.find('-');
+    if (!range.empty() && std::isdigit(static_cast<unsigned char>(range[0])))
+    {
+      int first = std::atoi(range.c_str());
+      int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+      for (int cpu = first; cpu <= last; ++cpu)
+        cpus.push_back(cpu);
+    }
+    pos = end + 1;
+  }
+  return cpus;
+}
+
+inline std::string read_sysfs(const std::string& path)
+{
+  std::ifstream file(path);
+  std::string value;
+  std::getline(file, value);
+  return value;
+}
+
+//NUMA节点上的CPU
+inline std::vector<int> numa_node_cpus(int node)
+{
+  std::vector<int> cpus = parse_cpu_list(
+      read_sysfs("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"));
+  if (cpus.empty())
+    throw std::runtime_error("no cpus on numa node " + std::to_string(node));
+  return cpus;
+}
+
+//spec为节点编号，或者网卡名（取网卡所在的节点，连接的中断和收包都在那里处理）
+inline int resolve_numa_node(const std::string& spec)
+{
+  if (!spec.empty() && std::isdigit(static_cast<unsigned char>(spec[0])))
+    return std::atoi(spec.c_str());
+  std::string value = read_sysfs("/sys/class/net/" + spec + "/device/numa_node");
+  if (value.empty() || std::atoi(value.c_str()) < 0)
+    throw std::runtime_error("cannot find numa node of " + spec);
+  return std::atoi(value.c_str());
+}
+
+//把当前线程绑定到这些CPU上，忙等时不被调度到别的核，缓存也一直是热的
+inline void pin_thread(const std::vector<int>& cpus)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu: cpus)
+    CPU_SET(cpu, &set);
+  int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (error != 0)
+    throw std::runtime_error(std::string("cannot set cpu affinity: ") + std::strerror(error));
+}
+
+//之后分配的内存优先放在这个节点上，本节点内存不够时再用其他节点的
+inline void prefer_numa_node(int node)
+{
+  const int bits = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> mask(node / bits + 1);
+  mask[node / bits] = 1UL << (node % bits);
+  //内核只取maxnode-1位
+  if (::syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask.data(),
+        static_cast<unsigned long>(mask.size() * bits + 1)) != 0)
+    throw std::runtime_error(std::string("set_mempolicy failed: ") + std::strerror(errno));
+}
+
+#endif // CPU_PLACEMENT_HPP
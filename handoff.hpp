@@ -0,0 +1,141 @@
+//
+// handoff.hpp
+// ~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef HANDOFF_HPP
+#define HANDOFF_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// 热升级时新旧进程之间在Unix域socket上交接的一条记录：一行文本头 + 任意数据，可以附带一个文件描述符
+// 线上格式：头部长度和数据长度（各4字节，网络字节序）+ 头部 + 数据，描述符用SCM_RIGHTS附在第一个字节上
+// 交接只在升级时发生一次，用阻塞读写，出错时抛异常
+struct handoff_record
+{
+  std::string header;
+  std::string payload;
+  int fd = -1;//收到的描述符归接收方所有，没有时为-1
+};
+
+//sock必须是阻塞的；fd不为-1时随记录发出，发送方自己的那份仍需自己关闭
+inline void send_record(int sock, const handoff_record& record)
+{
+  std::uint32_t prefix[2] = {
+    htonl(static_cast<std::uint32_t>(record.header.size())),
+    htonl(static_cast<std::uint32_t>(record.payload.size()))
+  };
+  iovec iov[3] = {
+    { prefix, sizeof(prefix) },
+    { const_cast<char*>(record.header.data()), record.header.size() },
+    { const_cast<char*>(record.payload.data()), record.payload.size() }
+  };
+  std::size_t total = sizeof(prefix) + record.header.size() + record.payload.size();
+
+  msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 3;
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+  if (record.fd >= 0)
+  {
+    std::memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &record.fd, sizeof(int));
+  }
+
+  std::size_t sent = 0;
+  while (sent < total)
+  {
+    ssize_t n = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      throw std::runtime_error(std::string("handoff send: ") + std::strerror(errno));
+    sent += static_cast<std::size_t>(n);
+    msg.msg_control = nullptr;//描述符只随第一段发出
+    msg.msg_controllen = 0;
+    while (msg.msg_iovlen > 0 && static_cast<std::size_t>(n) >= msg.msg_iov->iov_len)//跳过已发完的部分
+    {
+      n -= static_cast<ssize_t>(msg.msg_iov->iov_len);
+      ++msg.msg_iov;
+      --msg.msg_iovlen;
+    }
+    if (msg.msg_iovlen > 0)
+    {
+      msg.msg_iov->iov_base = static_cast<char*>(msg.msg_iov->iov_base) + n;
+      msg.msg_iov->iov_len -= static_cast<std::size_t>(n);
+    }
+  }
+}
+
+//读满size个字节，对端提前关闭时抛异常
+inline void recv_exactly(int sock, char* data, std::size_t size)
+{
+  while (size > 0)
+  {
+    ssize_t n = ::recv(sock, data, size, MSG_WAITALL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      throw std::runtime_error("handoff connection closed");
+    data += n;
+    size -= static_cast<std::size_t>(n);
+  }
+}
+
+//读一条记录，对端在记录边界上关闭时返回false
+//先只读长度前缀：描述符附在记录的第一个字节上，这样不会把下一条记录的描述符一起收进来
+inline bool recv_record(int sock, handoff_record& record)
+{
+  std::uint32_t prefix[2];
+  iovec iov = { prefix, sizeof(prefix) };
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+  msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t n;
+  do
+    n = ::recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  while (n < 0 && errno == EINTR);
+  if (n == 0)
+    return false;
+  if (n < 0)
+    throw std::runtime_error(std::string("handoff receive: ") + std::strerror(errno));
+
+  record.fd = -1;
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      std::memcpy(&record.fd, CMSG_DATA(cmsg), sizeof(int));
+  if (static_cast<std::size_t>(n) < sizeof(prefix))
+    recv_exactly(sock, reinterpret_cast<char*>(prefix) + n, sizeof(prefix) - n);
+
+  record.header.resize(ntohl(prefix[0]));
+  record.payload.resize(ntohl(prefix[1]));
+  if (!record.header.empty())
+    recv_exactly(sock, &record.header[0], record.header.size());
+  if (!record.payload.empty())
+    recv_exactly(sock, &record.payload[0], record.payload.size());
+  return true;
+}
+
+#endif // HANDOFF_HPP
@@ -0,0 +1,67 @@
+//
+// hash_ring.hpp
+// ~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef HASH_RING_HPP
+#define HASH_RING_HPP
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+// 一致性哈希环：每个节点在环上放vnodes个虚拟节点，key顺时针找到的第一个虚拟节点即为归属节点
+// 增删一个节点时只有约1/N的key换归属，其余不动
+// 哈希值在所有进程里必须一致，所以不用std::hash，而用FNV-1a加splitmix64的混合
+class hash_ring
+{
+public:
+  explicit hash_ring(int vnodes = 128)
+    : vnodes_(vnodes)
+  {
+  }
+
+  static std::uint64_t hash(const std::string& key)
+  {
+    std::uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c: key)
+    {
+      h ^= c;
+      h *= 1099511628211ULL;
+    }
+    //FNV对只差最后几个字符的key分布不够散，再混合一次
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+  }
+
+  void add(const std::string& node)
+  {
+    for (int i = 0; i < vnodes_; ++i)
+      ring_[hash(node + "#" + std::to_string(i))] = node;
+  }
+
+//key的归属节点，环为空时返回空字符串
+  const std::string& owner(const std::string& key) const
+  {
+    static const std::string none;
+    if (ring_.empty())
+      return none;
+    auto it = ring_.lower_bound(hash(key));
+    if (it == ring_.end())
+      it = ring_.begin();
+    return it->second;
+  }
+
+private:
+  int vnodes_;
+  std::map<std::uint64_t, std::string> ring_;
+};
+
+#endif // HASH_RING_HPP
@@ -0,0 +1,376 @@
+//
+// member_set.hpp
+// ~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef MEMBER_SET_HPP
+#define MEMBER_SET_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// 成员编号的集合，结构与Roaring位图相同：编号按高16位分块，每块只存低16位
+// 块里的成员不多时是有序的uint16数组，超过array_max个时换成65536位的位图（8KB），
+// 所以小聊天室只占几十个字节，大聊天室也不超过每65536个编号8KB，编号越稠密块越少
+// 并、差、交按块进行，两个位图块之间用SSE2一次算128位；遍历位图块时一次检查256位，整段为空的直接跳过，
+// 不为空的字用ctz逐个取出置位的编号
+class member_set
+{
+public:
+  using id_type = std::uint32_t;
+//返回false表示已经在集合中
+  bool add(id_type id)
+  {
+    auto it = find(key(id));
+    if (it == blocks_.end() || it->key != key(id))
+    {
+      it = blocks_.insert(it, block());
+      it->key = key(id);
+    }
+    if (!insert(*it, low(id)))
+      return false;
+    ++size_;
+    return true;
+  }
+//返回false表示不在集合中
+  bool remove(id_type id)
+  {
+    auto it = find(key(id));
+    if (it == blocks_.end() || it->key != key(id) || !erase(*it, low(id)))
+      return false;
+    --size_;
+    if (it->count == 0)
+      blocks_.erase(it);
+    return true;
+  }
+
+  bool contains(id_type id) const
+  {
+    auto it = std::lower_bound(blocks_.begin(), blocks_.end(), key(id),
+        [](const block& b, std::uint16_t k) { return b.key < k; });
+    if (it == blocks_.end() || it->key != key(id))
+      return false;
+    if (it->bitmap())
+      return (it->words[low(id) >> 6] >> (low(id) & 63)) & 1;
+    return std::binary_search(it->array.begin(), it->array.end(), low(id));
+  }
+
+  std::size_t size() const
+  {
+    return size_;
+  }
+
+  bool empty() const
+  {
+    return size_ == 0;
+  }
+
+  void clear()
+  {
+    blocks_.clear();
+    size_ = 0;
+  }
+//并：同时在两个集合里的编号只留一个
+  member_set& operator|=(const member_set& other)
+  {
+    for (const block& theirs: other.blocks_)
+    {
+      auto it = find(theirs.key);
+      if (it == blocks_.end() || it->key != theirs.key)
+      {
+        blocks_.insert(it, theirs);
+        continue;
+      }
+      block& ours = *it;
+      if (theirs.bitmap())
+      {
+        if (!ours.bitmap())
+          to_bitmap(ours);
+        ours.count = combine(ours.words, theirs.words, or_op);
+      }
+      else if (ours.bitmap())
+      {
+        for (std::uint16_t v: theirs.array)
+          set_bit(ours, v);
+      }
+      else
+      {
+        std::vector<std::uint16_t> merged;
+        merged.reserve(ours.array.size() + theirs.array.size());
+        std::set_union(ours.array.begin(), ours.array.end(),
+            theirs.array.begin(), theirs.array.end(), std::back_inserter(merged));
+        ours.array.swap(merged);
+        ours.count = static_cast<std::uint32_t>(ours.array.size());
+        if (ours.count > array_max)
+          to_bitmap(ours);
+      }
+    }
+    recount();
+    return *this;
+  }
+//差：去掉other中的编号
+  member_set& operator-=(const member_set& other)
+  {
+    for (block& ours: blocks_)
+    {
+      const block* theirs = other.lookup(ours.key);
+      if (!theirs)
+        continue;
+      if (ours.bitmap() && theirs->bitmap())
+        ours.count = combine(ours.words, theirs->words, andnot_op);
+      else if (ours.bitmap())
+        for (std::uint16_t v: theirs->array)
+          clear_bit(ours, v);
+      else
+        keep_if(ours, [theirs](std::uint16_t v) { return !has(*theirs, v); });
+    }
+    recount();
+    return *this;
+  }
+//交：只留下other中也有的编号
+  member_set& operator&=(const member_set& other)
+  {
+    for (block& ours: blocks_)
+    {
+      const block* theirs = other.lookup(ours.key);
+      if (!theirs)
+      {
+        ours.count = 0;
+      }
+      else if (ours.bitmap() && theirs->bitmap())
+      {
+        ours.count = combine(ours.words, theirs->words, and_op);
+      }
+      else if (ours.bitmap())//结果不会比对方的数组大，直接换成数组
+      {
+        std::vector<std::uint16_t> kept;
+        for (std::uint16_t v: theirs->array)
+          if (has(ours, v))
+            kept.push_back(v);
+        ours.words.clear();
+        ours.array.swap(kept);
+        ours.count = static_cast<std::uint32_t>(ours.array.size());
+      }
+      else
+      {
+        keep_if(ours, [theirs](std::uint16_t v) { return has(*theirs, v); });
+      }
+    }
+    recount();
+    return *this;
+  }
+//按编号从小到大依次调用f(id)，遍历期间不能修改集合
+  template <typename F>
+  void for_each(F f) const
+  {
+    for (const block& b: blocks_)
+    {
+      id_type base = id_type(b.key) << 16;
+      if (!b.bitmap())
+      {
+        for (std::uint16_t v: b.array)
+          f(base | v);
+        continue;
+      }
+      for (std::size_t i = 0; i < bitmap_words; i += 4)
+      {
+#if defined(__SSE2__)
+        __m128i any = _mm_or_si128(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(&b.words[i])),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(&b.words[i + 2])));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) == 0xffff)
+          continue;
+#endif
+        for (std::size_t j = i; j < i + 4; ++j)
+          for (std::uint64_t bits = b.words[j]; bits != 0; bits &= bits - 1)
+            f(base | id_type(j * 64 + __builtin_ctzll(bits)));
+      }
+    }
+  }
+
+private:
+  enum { array_max = 4096, bitmap_words = 65536 / 64 };
+  enum word_op { or_op, andnot_op, and_op };
+
+  struct block
+  {
+    std::uint16_t key = 0;//编号的高16位
+    std::uint32_t count = 0;//块里的编号数
+    std::vector<std::uint16_t> array;//有序，位图形式时为空
+    std::vector<std::uint64_t> words;//位图，数组形式时为空
+
+    bool bitmap() const
+    {
+      return !words.empty();
+    }
+  };
+
+  static std::uint16_t key(id_type id)
+  {
+    return static_cast<std::uint16_t>(id >> 16);
+  }
+
+  static std::uint16_t low(id_type id)
+  {
+    return static_cast<std::uint16_t>(id & 0xffff);
+  }
+
+  std::vector<block>::iterator find(std::uint16_t k)
+  {
+    return std::lower_bound(blocks_.begin(), blocks_.end(), k,
+        [](const block& b, std::uint16_t value) { return b.key < value; });
+  }
+
+  const block* lookup(std::uint16_t k) const
+  {
+    auto it = std::lower_bound(blocks_.begin(), blocks_.end(), k,
+        [](const block& b, std::uint16_t value) { return b.key < value; });
+    return it != blocks_.end() && it->key == k ? &*it : nullptr;
+  }
+
+  static bool has(const block& b, std::uint16_t v)
+  {
+    if (b.bitmap())
+      return (b.words[v >> 6] >> (v & 63)) & 1;
+    return std::binary_search(b.array.begin(), b.array.end(), v);
+  }
+
+  static bool set_bit(block& b, std::uint16_t v)
+  {
+    std::uint64_t bit = std::uint64_t(1) << (v & 63);
+    if (b.words[v >> 6] & bit)
+      return false;
+    b.words[v >> 6] |= bit;
+    ++b.count;
+    return true;
+  }
+
+  static void clear_bit(block& b, std::uint16_t v)
+  {
+    std::uint64_t bit = std::uint64_t(1) << (v & 63);
+    if (b.words[v >> 6] & bit)
+    {
+      b.words[v >> 6] &= ~bit;
+      --b.count;
+    }
+  }
+
+  static bool insert(block& b, std::uint16_t v)
+  {
+    if (b.bitmap())
+      return set_bit(b, v);
+    auto it = std::lower_bound(b.array.begin(), b.array.end(), v);
+    if (it != b.array.end() && *it == v)
+      return false;
+    b.array.insert(it, v);
+    if (++b.count > array_max)
+      to_bitmap(b);
+    return true;
+  }
+//位图块降到array_max的一半以下才换回数组，成员数在分界线附近进出时不会来回转换
+  static bool erase(block& b, std::uint16_t v)
+  {
+    if (b.bitmap())
+    {
+      std::uint32_t before = b.count;
+      clear_bit(b, v);
+      if (b.count == before)
+        return false;
+      if (b.count <= array_max / 2)
+        to_array(b);
+      return true;
+    }
+    auto it = std::lower_bound(b.array.begin(), b.array.end(), v);
+    if (it == b.array.end() || *it != v)
+      return false;
+    b.array.erase(it);
+    --b.count;
+    return true;
+  }
+
+  static void to_bitmap(block& b)
+  {
+    b.words.assign(bitmap_words, 0);
+    for (std::uint16_t v: b.array)
+      b.words[v >> 6] |= std::uint64_t(1) << (v & 63);
+    b.array.clear();
+    b.array.shrink_to_fit();
+  }
+
+  static void to_array(block& b)
+  {
+    b.array.clear();
+    b.array.reserve(b.count);
+    for (std::size_t i = 0; i < bitmap_words; ++i)
+      for (std::uint64_t bits = b.words[i]; bits != 0; bits &= bits - 1)
+        b.array.push_back(static_cast<std::uint16_t>(i * 64 + __builtin_ctzll(bits)));
+    b.words.clear();
+    b.words.shrink_to_fit();
+  }
+
+  template <typename Pred>
+  static void keep_if(block& b, Pred keep)
+  {
+    b.array.erase(std::remove_if(b.array.begin(), b.array.end(),
+          [&keep](std::uint16_t v) { return !keep(v); }), b.array.end());
+    b.count = static_cast<std::uint32_t>(b.array.size());
+  }
+//两个位图块逐位运算，结果写回dst，返回结果中的编号数
+  static std::uint32_t combine(std::vector<std::uint64_t>& dst,
+      const std::vector<std::uint64_t>& src, word_op op)
+  {
+    std::size_t i = 0;
+#if defined(__SSE2__)
+    for (; i < bitmap_words; i += 2)
+    {
+      __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&dst[i]));
+      __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&src[i]));
+      if (op == or_op)
+        a = _mm_or_si128(a, b);
+      else if (op == and_op)
+        a = _mm_and_si128(a, b);
+      else
+        a = _mm_andnot_si128(b, a);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(&dst[i]), a);
+    }
+#endif
+    for (; i < bitmap_words; ++i)
+      dst[i] = op == or_op ? dst[i] | src[i] : op == and_op ? dst[i] & src[i] : dst[i] & ~src[i];
+
+    std::uint32_t count = 0;
+    for (std::uint64_t w: dst)
+      count += static_cast<std::uint32_t>(__builtin_popcountll(w));
+    return count;
+  }
+//集合运算之后：去掉空块，位图块太稀疏时换回数组，重新算总数
+  void recount()
+  {
+    size_ = 0;
+    for (auto it = blocks_.begin(); it != blocks_.end();)
+    {
+      if (it->count == 0)
+      {
+        it = blocks_.erase(it);
+        continue;
+      }
+      if (it->bitmap() && it->count <= array_max / 2)
+        to_array(*it);
+      size_ += it->count;
+      ++it;
+    }
+  }
+
+  std::vector<block> blocks_;//按key排序
+  std::size_t size_ = 0;
+};
+
+#endif // MEMBER_SET_HPP
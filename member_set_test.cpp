@@ -0,0 +1,155 @@
+//
+// member_set_test.cpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// member_set与std::set对照：随机增删和并、差、交，成员数跨过数组/位图的分界线（4096进、2048出）
+// make test 编译运行，全部通过时输出ok，否则输出出错的位置并返回1
+
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <set>
+#include "member_set.hpp"
+
+using id_set = std::set<std::uint32_t>;
+
+static int failures = 0;
+
+#define CHECK(cond) \
+  do { if (!(cond)) { ++failures; std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond "\n"; } } while (0)
+
+//用for_each取出全部编号，同时检查顺序和size()
+static id_set dump(const member_set& m)
+{
+  id_set s;
+  bool ordered = true;
+  m.for_each(
+      [&s, &ordered](std::uint32_t id)
+      {
+        if (!s.empty() && id <= *s.rbegin())
+          ordered = false;
+        s.insert(id);
+      });
+  CHECK(ordered);
+  CHECK(s.size() == m.size());
+  CHECK(m.empty() == s.empty());
+  return s;
+}
+
+//同一个块里逐个加到位图再逐个删回数组，每一步都和std::set对照
+static void test_thresholds()
+{
+  member_set m;
+  id_set s;
+  for (std::uint32_t id = 0; id < 5000; ++id)
+  {
+    CHECK(m.add(id * 13 % 65536) == s.insert(id * 13 % 65536).second);
+    if (id == 4095 || id == 4096 || id == 4097)
+      CHECK(dump(m) == s);
+  }
+  CHECK(!m.add(13));
+  for (std::uint32_t id = 0; id < 5000; ++id)
+  {
+    CHECK(m.remove(id * 13 % 65536) == (s.erase(id * 13 % 65536) == 1));
+    if (s.size() >= 2047 && s.size() <= 2049)
+      CHECK(dump(m) == s);
+  }
+  CHECK(!m.remove(13));
+  CHECK(m.empty());
+}
+
+static id_set set_union(const id_set& a, const id_set& b)
+{
+  id_set r = a;
+  r.insert(b.begin(), b.end());
+  return r;
+}
+
+static id_set set_difference(const id_set& a, const id_set& b)
+{
+  id_set r;
+  for (std::uint32_t id: a)
+    if (!b.count(id))
+      r.insert(id);
+  return r;
+}
+
+static id_set set_intersection(const id_set& a, const id_set& b)
+{
+  id_set r;
+  for (std::uint32_t id: a)
+    if (b.count(id))
+      r.insert(id);
+  return r;
+}
+
+//编号范围从一个块内到跨几个块，成员数从几个到几万，两边的块可能一个是数组一个是位图
+static void test_random()
+{
+  std::mt19937 random(1);
+  const std::uint32_t ranges[] = { 3000, 20000, 200000 };
+  for (int round = 0; round < 60; ++round)
+  {
+    std::uint32_t range = ranges[round % 3];
+    member_set a, b;
+    id_set sa, sb;
+    int n = static_cast<int>(random() % 30000);
+    for (int i = 0; i < n; ++i)
+    {
+      std::uint32_t id = random() % range;
+      CHECK(a.add(id) == sa.insert(id).second);
+    }
+    for (int i = 0; i < n / 2; ++i)
+    {
+      std::uint32_t id = random() % range;
+      CHECK(a.remove(id) == (sa.erase(id) == 1));
+    }
+    int m = static_cast<int>(random() % 30000);
+    for (int i = 0; i < m; ++i)
+    {
+      std::uint32_t id = random() % range;
+      b.add(id);
+      sb.insert(id);
+    }
+    for (int i = 0; i < 100; ++i)
+    {
+      std::uint32_t id = random() % range;
+      CHECK(a.contains(id) == (sa.count(id) == 1));
+    }
+    CHECK(dump(a) == sa);
+    CHECK(dump(b) == sb);
+
+    member_set u = a;
+    u |= b;
+    CHECK(dump(u) == set_union(sa, sb));
+    member_set d = a;
+    d -= b;
+    CHECK(dump(d) == set_difference(sa, sb));
+    member_set e = b;
+    e -= a;
+    CHECK(dump(e) == set_difference(sb, sa));
+    member_set x = a;
+    x &= b;
+    CHECK(dump(x) == set_intersection(sa, sb));
+    member_set y = b;
+    y &= a;
+    CHECK(dump(y) == set_intersection(sa, sb));
+  }
+}
+
+int main()
+{
+  test_thresholds();
+  test_random();
+  if (failures != 0)
+  {
+    std::cerr << failures << " checks failed\n";
+    return 1;
+  }
+  std::cout << "ok\n";
+  return 0;
+}
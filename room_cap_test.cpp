@@ -0,0 +1,147 @@
+//
+// room_cap_test.cpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// 启动 ./server --max-rooms=4 --room-linger=0，检查聊天室名额：几个客户端各进一个聊天室、发一条消息占满名额，
+// 新的 /join 被拒绝；它们断开后名额空出来，新的 /join 成功，回收过的聊天室再 /resume 时编号从1重新开始
+// make test 编译运行，全部通过时输出ok，否则输出出错的位置并返回1
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(cond) \
+  do { if (!(cond)) { ++failures; std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond "\n"; } } while (0)
+
+static const int port = 47731;
+
+//连上测试服务器，服务器刚启动时多试几次
+static int connect_server()
+{
+  for (int attempt = 0; attempt < 50; ++attempt)
+  {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+    {
+      timeval timeout = {2, 0};
+      ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      return fd;
+    }
+    ::close(fd);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  return -1;
+}
+//按chat_message的格式发：四位十进制长度加消息体
+static void send_text(int fd, const std::string& text)
+{
+  char header[5];
+  std::snprintf(header, sizeof(header), "%4d", static_cast<int>(text.size()));
+  std::string frame = header + text;
+  CHECK(::send(fd, frame.data(), frame.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(frame.size()));
+}
+
+static bool read_exact(int fd, char* data, std::size_t length)
+{
+  while (length > 0)
+  {
+    ssize_t n = ::recv(fd, data, length, 0);
+    if (n <= 0)
+      return false;
+    data += n;
+    length -= n;
+  }
+  return true;
+}
+//跳过其他消息，返回第一条以prefix开头的，超时返回空
+static std::string wait_for(int fd, const std::string& prefix)
+{
+  char header[5] = "";
+  while (read_exact(fd, header, 4))
+  {
+    std::string body(std::atoi(header), '\0');
+    if (!read_exact(fd, &body[0], body.size()))
+      break;
+    if (body.compare(0, prefix.size(), prefix) == 0)
+      return body;
+  }
+  return std::string();
+}
+
+static void test_room_cap()
+{
+  //三个客户端各占一个聊天室，默认聊天室随之空出来；新连上的客户端在默认聊天室里，占第四个名额
+  std::vector<int> owners;
+  for (int i = 0; i < 3; ++i)
+  {
+    int fd = connect_server();
+    CHECK(fd >= 0);
+    std::string room = "r" + std::to_string(i);
+    send_text(fd, "/join " + room);
+    CHECK(wait_for(fd, "/join") == "/join " + room);
+    send_text(fd, "hello " + room);
+    CHECK(wait_for(fd, "hello") == "hello " + room);
+    owners.push_back(fd);
+  }
+
+  int late = connect_server();
+  CHECK(late >= 0);
+  send_text(late, "/join fresh");
+  CHECK(wait_for(late, "/join") == "/join too many rooms");
+  send_text(late, "/join r0");//有成员的聊天室不占新名额
+  CHECK(wait_for(late, "/join") == "/join r0");
+
+  for (int fd: owners)
+    ::close(fd);
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));//断开、回收（--room-linger=0，一个tick之后）
+
+  send_text(late, "/join fresh");
+  CHECK(wait_for(late, "/join") == "/join fresh");
+  send_text(late, "/resume r1 1");//r1已回收，编号从1重新开始
+  CHECK(wait_for(late, "/seq") == "/seq r1 1");
+  ::close(late);
+}
+
+int main()
+{
+  pid_t server = ::fork();
+  if (server == 0)
+  {
+    std::string address = std::to_string(port);
+    ::execl("./server", "./server", "--max-rooms=4", "--room-linger=0", address.c_str(),
+        static_cast<char*>(nullptr));
+    std::_Exit(127);
+  }
+
+  test_room_cap();
+  ::kill(server, SIGKILL);
+  ::waitpid(server, nullptr, 0);
+  if (failures != 0)
+  {
+    std::cerr << failures << " checks failed\n";
+    return 1;
+  }
+  std::cout << "ok\n";
+  return 0;
+}
@@ -0,0 +1,159 @@
+//
+// shm_ring.hpp
+// ~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef SHM_RING_HPP
+#define SHM_RING_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "chat_message.hpp"
+
+// 共享内存中的单生产者单消费者环形缓冲区，装的是首尾相接的chat_message（包头+包体，与socket上的格式相同）
+// 同一台机器上的生产者和服务器各自映射同一个文件（一般在/dev/shm下），生产者写入时没有系统调用、没有锁，
+// 只在写完一条消息后用release语义推进tail；消费者用acquire读tail，取完一批后推进head
+// head和tail都是累计的字节数，不回绕，取模后才是在数据区中的位置；二者放在不同的缓存行上，避免来回失效
+// 文件里的head在进程退出后仍然有效，服务器重启或热升级后从上次停下的地方接着取
+class shm_ring
+{
+public:
+//打开path，不存在时创建并初始化；capacity为数据区字节数，向上取2的幂
+//已有的文件容量不同时抛异常，双方必须用同样的容量
+  shm_ring(const std::string& path, std::size_t capacity)
+  {
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared memory needs lock-free 64-bit atomics");
+    capacity_ = 4096;
+    while (capacity_ < capacity)
+      capacity_ <<= 1;
+    size_ = sizeof(header) + capacity_;
+
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+      throw std::runtime_error("cannot open " + path + ": " + std::strerror(errno));
+    ::flock(fd, LOCK_EX);//两边同时启动时只有一边初始化
+    struct stat st;
+    bool fresh = ::fstat(fd, &st) == 0 && st.st_size == 0;
+    if (fresh && ::ftruncate(fd, static_cast<off_t>(size_)) != 0)
+    {
+      ::close(fd);
+      throw std::runtime_error("cannot resize " + path + ": " + std::strerror(errno));
+    }
+    if (!fresh && static_cast<std::size_t>(st.st_size) != size_)
+    {
+      ::close(fd);
+      throw std::runtime_error(path + " has a different ring size");
+    }
+    void* base = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+    {
+      ::close(fd);
+      throw std::runtime_error("cannot map " + path + ": " + std::strerror(errno));
+    }
+    header_ = static_cast<header*>(base);
+    data_ = static_cast<char*>(base) + sizeof(header);//数据区从第4个缓存行开始
+    if (fresh)
+    {
+      new (&header_->tail) std::atomic<std::uint64_t>(0);
+      new (&header_->head) std::atomic<std::uint64_t>(0);
+      header_->capacity = capacity_;
+      header_->magic = magic;
+    }
+    ::flock(fd, LOCK_UN);
+    ::close(fd);//映射不依赖描述符
+    if (header_->magic != magic || header_->capacity != capacity_)
+    {
+      ::munmap(header_, size_);
+      throw std::runtime_error(path + " is not a chat ring");
+    }
+  }
+
+  ~shm_ring()
+  {
+    ::munmap(header_, size_);
+  }
+
+  shm_ring(const shm_ring&) = delete;
+  shm_ring& operator=(const shm_ring&) = delete;
+//生产者：写入一条消息，空间不够时立即返回false，由生产者决定丢弃还是稍后重试
+  bool push(const chat_message& msg)
+  {
+    std::uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+    std::uint64_t head = header_->head.load(std::memory_order_acquire);
+    if (capacity_ - (tail - head) < msg.length())
+      return false;
+    copy_in(tail, msg.data(), msg.length());
+    header_->tail.store(tail + msg.length(), std::memory_order_release);
+    return true;
+  }
+//消费者：最多取出max条消息，依次交给handler(const chat_message&)，返回取出的条数
+//包头不合法说明生产者写坏了数据，抛异常，之后不应再读这个环
+  template <typename Handler>
+  std::size_t pop(Handler handler, std::size_t max)
+  {
+    std::uint64_t head = header_->head.load(std::memory_order_relaxed);
+    std::uint64_t tail = header_->tail.load(std::memory_order_acquire);
+    std::size_t count = 0;
+    chat_message msg;
+    while (count < max && tail - head >= chat_message::header_length)
+    {
+      copy_out(head, msg.data(), chat_message::header_length);
+      if (!msg.decode_header() || tail - head < msg.length())
+        throw std::runtime_error("corrupt chat ring");
+      copy_out(head + chat_message::header_length, msg.body(), msg.body_length());
+      head += msg.length();
+      ++count;
+      handler(msg);
+    }
+    header_->head.store(head, std::memory_order_release);//一批只写一次，生产者那边的缓存行只失效一次
+    return count;
+  }
+
+private:
+  enum : std::uint64_t { magic = 0x676e6972746168ULL };//"hatring"
+
+  struct header
+  {
+    std::uint64_t magic;
+    std::uint64_t capacity;
+    alignas(64) std::atomic<std::uint64_t> tail;//生产者写
+    alignas(64) std::atomic<std::uint64_t> head;//消费者写
+  };
+
+  void copy_in(std::uint64_t position, const char* data, std::size_t length)
+  {
+    std::size_t offset = position & (capacity_ - 1);
+    std::size_t first = std::min(length, capacity_ - offset);//到数据区末尾为止，剩下的从头开始
+    std::memcpy(data_ + offset, data, first);
+    std::memcpy(data_, data + first, length - first);
+  }
+
+  void copy_out(std::uint64_t position, char* data, std::size_t length) const
+  {
+    std::size_t offset = position & (capacity_ - 1);
+    std::size_t first = std::min(length, capacity_ - offset);
+    std::memcpy(data, data_ + offset, first);
+    std::memcpy(data + first, data_, length - first);
+  }
+
+  header* header_;
+  char* data_;
+  std::size_t capacity_;
+  std::size_t size_;
+};
+
+#endif // SHM_RING_HPP
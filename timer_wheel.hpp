@@ -0,0 +1,140 @@
+//
+// timer_wheel.hpp
+// ~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+
+// 分层时间轮：所有定时任务共用一个steady_timer，每个tick推进一格
+// 4层、每层256格，能表示2^32个tick以内的延迟；添加任务O(1)，
+// 每个任务到期前最多从高层往低层搬动3次，所以无论有多少任务，每个tick的开销只与当格到期的任务数有关
+// 任务不能取消，回调里自己判断是否仍然有效（例如持有weak_ptr，或比对代数）
+// 没有任务时不tick
+class timer_wheel
+{
+public:
+  using clock = std::chrono::steady_clock;
+  using callback = std::function<void()>;
+
+  timer_wheel(boost::asio::io_context& io_context, std::chrono::milliseconds tick)
+    : timer_(io_context),
+      tick_(tick),
+      start_(clock::now())
+  {
+  }
+//当前tick；有任务时最多落后真实时间一个tick，没有任务时不更新
+  std::uint64_t now() const
+  {
+    return current_;
+  }
+//把时长换算成tick数，向上取整
+  std::uint64_t ticks(std::chrono::milliseconds duration) const
+  {
+    return (duration.count() + tick_.count() - 1) / tick_.count();
+  }
+//ticks个tick之后执行cb，至少为1；当前tick已经过去了一部分，所以实际延迟在(ticks-1, ticks]个tick之间
+  void schedule(std::uint64_t ticks, callback cb)
+  {
+    if (size_ == 0)
+      current_ = elapsed();//没有任务时不tick，直接追上当前时间
+    insert(current_ + std::max<std::uint64_t>(ticks, 1), std::move(cb));
+    if (!running_)
+      arm();
+  }
+
+private:
+  enum { slot_bits = 8, slots = 1 << slot_bits, levels = 4 };
+
+  struct entry
+  {
+    std::uint64_t expiry;
+    callback cb;
+  };
+
+  std::uint64_t elapsed() const
+  {
+    return static_cast<std::uint64_t>((clock::now() - start_) / tick_);
+  }
+//放在与当前tick第一个不同的那一层：同一层内只有到期的那一格与当前不同，
+//等当前tick走到那一格的起点时整格下沉，最后在第0层到期
+  void insert(std::uint64_t expiry, callback cb)
+  {
+    int level = 0;
+    while (level + 1 < levels
+        && (expiry >> (slot_bits * (level + 1))) != (current_ >> (slot_bits * (level + 1))))
+      ++level;
+    std::size_t slot = (expiry >> (slot_bits * level)) & (slots - 1);
+    wheel_[level][slot].push_back(entry{expiry, std::move(cb)});
+    ++size_;
+  }
+
+  void arm()
+  {
+    running_ = true;
+    timer_.expires_at(start_ + tick_ * (current_ + 1));
+    timer_.async_wait(
+        [this](boost::system::error_code ec)
+        {
+          if (ec)
+          {
+            running_ = false;
+            return;
+          }
+          std::uint64_t target = elapsed();
+          while (current_ < target && size_ > 0)//事件循环被耽误时一次补上多个tick
+            step();
+          if (size_ > 0)
+            arm();
+          else
+            running_ = false;
+        });
+  }
+//推进一格：先从高层往低层下沉本tick起点对应的格子，再执行第0层当格到期的任务
+  void step()
+  {
+    ++current_;
+    int top = 0;
+    while (top + 1 < levels
+        && (current_ & ((std::uint64_t(1) << (slot_bits * (top + 1))) - 1)) == 0)
+      ++top;
+    for (int level = top; level > 0; --level)
+      cascade(level, (current_ >> (slot_bits * level)) & (slots - 1));
+
+    std::vector<entry> due;
+    due.swap(wheel_[0][current_ & (slots - 1)]);
+    size_ -= due.size();
+    for (auto& e: due)
+      e.cb();//回调里可以再添加任务
+  }
+
+  void cascade(int level, std::size_t slot)
+  {
+    std::vector<entry> moving;
+    moving.swap(wheel_[level][slot]);
+    size_ -= moving.size();
+    for (auto& e: moving)
+      insert(e.expiry, std::move(e.cb));
+  }
+
+  boost::asio::steady_timer timer_;
+  std::chrono::milliseconds tick_;
+  clock::time_point start_;
+  std::uint64_t current_ = 0;
+  std::size_t size_ = 0;//所有层中的任务总数
+  bool running_ = false;
+  std::vector<entry> wheel_[levels][slots];
+};
+
+#endif // TIMER_WHEEL_HPP
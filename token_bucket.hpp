@@ -0,0 +1,89 @@
+//
+// token_bucket.hpp
+// ~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef TOKEN_BUCKET_HPP
+#define TOKEN_BUCKET_HPP
+
+#include <algorithm>
+#include <chrono>
+
+// 令牌桶：以rate个/秒的速度补充令牌，最多攒burst个
+// 允许欠账：consume()总是扣除，返回把欠账还清还需要等待的时间
+class token_bucket
+{
+public:
+  using clock = std::chrono::steady_clock;
+
+  token_bucket(double rate = 0, double burst = 0)
+    : rate_(rate),
+      burst_(std::max(burst, rate)),
+      tokens_(burst_),
+      last_(clock::now())
+  {
+  }
+//rate为0表示不限速
+  bool enabled() const
+  {
+    return rate_ > 0;
+  }
+//扣除n个令牌，返回需要暂停多久令牌数才能回到非负
+  clock::duration consume(double n, clock::time_point now)
+  {
+    if (!enabled())
+      return clock::duration::zero();
+
+    refill(now);
+    tokens_ -= n;
+    if (tokens_ >= 0)
+      return clock::duration::zero();
+    return std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double>(-tokens_ / rate_));
+  }
+
+private:
+  void refill(clock::time_point now)
+  {
+    std::chrono::duration<double> elapsed = now - last_;
+    last_ = now;
+    tokens_ = std::min(burst_, tokens_ + elapsed.count() * rate_);
+  }
+
+  double rate_;
+  double burst_;
+  double tokens_;
+  clock::time_point last_;
+};
+
+// 一组限速：每秒消息数 + 每秒字节数
+class rate_limiter
+{
+public:
+  rate_limiter(double msgs_per_sec = 0, double bytes_per_sec = 0)
+    : messages_(msgs_per_sec),
+      bytes_(bytes_per_sec)
+  {
+  }
+
+  bool enabled() const
+  {
+    return messages_.enabled() || bytes_.enabled();
+  }
+//记一条长度为length的消息，返回需要暂停读取的时长
+  token_bucket::clock::duration consume(std::size_t length,
+      token_bucket::clock::time_point now)
+  {
+    return std::max(messages_.consume(1, now),
+        bytes_.consume(static_cast<double>(length), now));
+  }
+
+private:
+  token_bucket messages_;
+  token_bucket bytes_;
+};
+
+#endif // TOKEN_BUCKET_HPP
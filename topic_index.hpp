@@ -0,0 +1,111 @@
+//
+// topic_index.hpp
+// ~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef TOPIC_INDEX_HPP
+#define TOPIC_INDEX_HPP
+
+#include <cctype>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include "member_set.hpp"
+
+// 订阅过滤的倒排索引：每个过滤条件对应一个成员集合（按成员编号），匹配一条消息时
+// 只用消息本身的词去查表，把命中的集合并起来，开销与消息长度和命中的成员数有关，与过滤条件总数无关
+// 过滤条件的写法，同时也是它在表里的键：
+//   #tag    消息中有这个标签（以#开头的词）
+//   @name   发送者为name：消息以 "name: " 开头
+//   ^text   消息以text开头
+//   word    消息中有这个词（按空白分词，整词匹配）
+class topic_index
+{
+public:
+  enum { max_filter_length = 64 };
+//过滤条件必须是一个不含空白的词，前缀标记后面至少一个字符
+  static bool valid(const std::string& filter)
+  {
+    if (filter.empty() || filter.size() > max_filter_length)
+      return false;
+    if ((filter[0] == '#' || filter[0] == '@' || filter[0] == '^') && filter.size() < 2)
+      return false;
+    for (char c: filter)
+      if (std::isspace(static_cast<unsigned char>(c)))
+        return false;
+    return true;
+  }
+
+  void add(std::uint32_t member, const std::string& filter)
+  {
+    if (!keys_[filter].add(member))
+      return;
+    if (filter[0] == '^')
+      ++prefix_lengths_[filter.size() - 1];
+  }
+
+  void remove(std::uint32_t member, const std::string& filter)
+  {
+    auto it = keys_.find(filter);
+    if (it == keys_.end() || !it->second.remove(member))
+      return;
+    if (it->second.empty())
+      keys_.erase(it);
+    if (filter[0] == '^')
+      --prefix_lengths_[filter.size() - 1];
+  }
+//body匹配的成员放进matched（先清空）
+  void match(const char* body, std::size_t length, member_set& matched) const
+  {
+    matched.clear();
+    if (keys_.empty())
+      return;
+    std::string key;
+    std::size_t pos = 0;
+    bool first = true;
+    while (pos < length)
+    {
+      while (pos < length && std::isspace(static_cast<unsigned char>(body[pos])))
+        ++pos;
+      std::size_t end = pos;
+      while (end < length && !std::isspace(static_cast<unsigned char>(body[end])))
+        ++end;
+      if (end > pos)
+      {
+        key.assign(body + pos, end - pos);
+        merge(key, matched);//#tag和普通的词
+        if (first && key.size() > 1 && key.back() == ':')
+        {
+          key.pop_back();
+          merge("@" + key, matched);
+        }
+        first = false;
+      }
+      pos = end;
+    }
+
+    key = "^";
+    for (std::size_t n = 1; n < max_filter_length && n <= length; ++n)
+    {
+      key += body[n - 1];
+      if (prefix_lengths_[n] > 0)
+        merge(key, matched);
+    }
+  }
+
+private:
+  void merge(const std::string& key, member_set& matched) const
+  {
+    auto it = keys_.find(key);
+    if (it != keys_.end())
+      matched |= it->second;
+  }
+
+  std::unordered_map<std::string, member_set> keys_;
+  std::size_t prefix_lengths_[max_filter_length] = {};//各长度的前缀条件有多少个，没有的长度不用查表
+};
+
+#endif // TOPIC_INDEX_HPP